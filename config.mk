@@ -6,6 +6,10 @@ prefix = /usr/local
 # flags
 DEBUGFLAGS = -g -O0 -Wall -Werror -ansi ${INCS} -DVERSION=\"${VERSION}\"
 CFLAGS = -Os -Wall -Werror -ansi ${INCS} -DVERSION=\"${VERSION}\"
+LDFLAGS = -pthread
 
 # compiler
 CC = cc
+
+# lili to compare against when benchmarking
+BASELINE = lili
@@ -1,73 +1,140 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <time.h>
 #include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <stdarg.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
-char ATSIGN = '@';
-int line_number = 1;
+typedef union Alignment
+{
+    long l;
+    double d;
+    void * p;
+} alignment;
 
-typedef struct List
+typedef struct ArenaBlock
 {
-    void * data;
-    struct List * successor;
-} list;
+    struct ArenaBlock * previous;
+    size_t size;
+    size_t used;
+    alignment data[1];
+} arena_block;
 
-/* a list must be initialized with data */
-list * list_new(void * d)
+typedef struct Arena
 {
-    list * l = malloc(sizeof(list));
-    l->data = d;
-    l->successor = NULL;
-    return l;
+    arena_block * block;
+    size_t block_size;
+    unsigned long bytes;
+    unsigned long allocations;
+    unsigned long blocks;
+} arena;
+
+void exit_fail_if(int condition, char * message, ...);
+
+/* set the size of the next block, e.g. based on the size of the input */
+void arena_reserve(arena * a, size_t size)
+{
+    if (size > a->block_size) a->block_size = size;
 }
 
-/* we need a double pointer so that if we are passed lst == NULL we mutate *lst
- * so that it points to a new list. This happens in dict_add if the new chunk
- * is hashed into a bucket not already containing a pointer to a list */
-void list_push_back(list ** lst, void * elem)
+void * arena_alloc(arena * a, size_t size)
 {
-    list * a = list_new(elem);
-    if (*lst == NULL)
+    void * p;
+    size = (size + sizeof(alignment) - 1) / sizeof(alignment) * sizeof(alignment); /* (1) */
+    if (a->block == NULL || a->block->size - a->block->used < size)
     {
-        *lst = a;
-    }
-    else
-    {
-        list * l = *lst;
-        while (l->successor != NULL) l = l->successor; /* go to the end of l */
-        l->successor = a;
+        arena_block * b;
+        if (a->block != NULL) a->block_size *= 2; /* (2) */
+        if (a->block_size < size) a->block_size = size;
+        b = malloc(sizeof(arena_block) + a->block_size);
+        exit_fail_if(b == NULL, "Error: Out of memory\n");
+        b->previous = a->block;
+        b->size = a->block_size;
+        b->used = 0;
+        a->block = b;
+        a->blocks += 1;
     }
+    p = (char *)a->block->data + a->block->used;
+    a->block->used += size;
+    a->bytes += size;
+    a->allocations += 1;
+    return p;
 }
 
-void list_pop_back(list ** lst)
+/* a null terminated copy of a string from the source */
+char * arena_strndup(arena * a, const char * string, size_t length)
 {
-    if (*lst == NULL) return;
-    if ((*lst)->successor == NULL)
+    char * copy = arena_alloc(a, length + 1);
+    memcpy(copy, string, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+/* release every block but the last, which is the largest, and empty it */
+void arena_reset(arena * a)
+{
+    arena_block * b = a->block;
+    if (b == NULL) return;
+    while (b->previous != NULL)
     {
-        free((void *)(*lst));
-        *lst = NULL;
-        return;
+        arena_block * p = b->previous;
+        b->previous = p->previous;
+        free(p);
     }
-    else
+    b->used = 0;
+    a->bytes = 0;
+    a->allocations = 0;
+}
+
+void arena_free(arena * a)
+{
+    while (a->block != NULL)
     {
-        list * l1 = *lst;
-        list * l2 = (*lst)->successor;
-        while (l2->successor != NULL) 
-        {
-            l1 = l2;
-            l2 = l2->successor;
-        }
-        free((void *)l2);
-        l1->successor = NULL;
-        return;
+        arena_block * b = a->block;
+        a->block = b->previous;
+        free(b);
     }
 }
+typedef struct List
+{
+    void * data;
+    struct List * successor;
+} list;
+
+/* a list must be initialized with data */
+list * list_new(arena * a, void * d)
+{
+    list * l = arena_alloc(a, sizeof(list));
+    l->data = d;
+    l->successor = NULL;
+    return l;
+}
 
-void list_push(list ** lst, void * elem)
+/* we need a double pointer so that if we are passed lst == NULL we mutate *lst
+ * so that it points to a new list. */
+void list_push(arena * a, list ** lst, void * elem)
 {
-    list * p = list_new(elem);
+    list * p = list_new(a, elem);
     if (*lst == NULL)
     {
         *lst = p;
@@ -86,20 +153,71 @@ void list_pop(list ** lst)
     if (p == NULL) return;
     list * l = p->successor;
     *lst = l;
-    free((void *)p);
 }
+typedef struct Digest
+{
+    unsigned long fnv;
+    unsigned long djb;
+    size_t length;
+} digest;
+
+void digest_init(digest * h)
+{
+    h->fnv = 2166136261UL;
+    h->djb = 5381;
+    h->length = 0;
+}
+
+void digest_update(digest * h, const char * str, size_t length)
+{
+    const unsigned char * s = (const unsigned char *)str;
+    unsigned long fnv = h->fnv, djb = h->djb;
+    h->length += length;
+    while (length--)
+    {
+        fnv = ((fnv ^ *s) * 16777619UL) & 0xffffffffUL;
+        djb = ((djb << 5) + djb + *s++) & 0xffffffffUL;
+    }
+    h->fnv = fnv;
+    h->djb = djb;
+}
+
+int digest_equal(digest * a, digest * b)
+{
+    return a->fnv == b->fnv && a->djb == b->djb && a->length == b->length;
+}
+/* http://www.isthe.com/chongo/tech/comp/fnv/ */
+unsigned long hash(const char * str, size_t length)
+{
+    const unsigned char * s = (const unsigned char *)str;
+    unsigned long hash = 2166136261UL;
+
+    while (length--) hash = ((hash ^ *s++) * 16777619UL) & 0xffffffffUL;
+
+    return hash;
+}
+
 typedef struct CodeChunk
 {
-    char * name;
-    list * contents;
-    int invocations;
+    const char * name;
+    size_t name_length;
+    unsigned long hash;
+    struct ChunkContents * contents;
+    struct ChunkContents * last;
+    size_t index;
+    int line;
+    int defined;
     int tangle;
+    int reusable;
 } code_chunk;
 typedef struct ChunkContents
 {
-    char * string;
+    const char * string;
+    size_t length;
     code_chunk * reference;
     int partial_line;
+    int line;
+    struct ChunkContents * successor;
 } chunk_contents;
 typedef enum ContentType {code, reference} content_t;
 
@@ -109,77 +227,416 @@ content_t contents_type(chunk_contents * c)
     else return code;
 }
 
-chunk_contents * code_contents_new(char * code)
+chunk_contents * code_contents_new(arena * a, const char * code, size_t length, int line)
 {
-    chunk_contents * c = malloc(sizeof(chunk_contents));
+    chunk_contents * c = arena_alloc(a, sizeof(chunk_contents));
     c->string = code;
+    c->length = length;
     c->reference = NULL;
     c->partial_line = 0;
+    c->line = line;
+    c->successor = NULL;
     return c;
 }
 
-chunk_contents * reference_contents_new(char * indent, code_chunk * ref)
+chunk_contents * reference_contents_new( arena * a, const char * indent, size_t length
+                                       , code_chunk * ref, int line
+                                       )
 {
-    chunk_contents * c = malloc(sizeof(chunk_contents));
+    chunk_contents * c = arena_alloc(a, sizeof(chunk_contents));
     c->string = indent;
+    c->length = length;
     c->reference = ref;
     c->partial_line = 0;
+    c->line = line;
+    c->successor = NULL;
     return c;
 }
 
-code_chunk * code_chunk_new(char * name)
+code_chunk * code_chunk_new(arena * a, const char * name, size_t name_length)
 {
-    code_chunk * chunk = malloc(sizeof(code_chunk));
+    code_chunk * chunk = arena_alloc(a, sizeof(code_chunk));
     chunk->name     = name;
+    chunk->name_length = name_length;
+    chunk->hash     = hash(name, name_length);
     chunk->contents = NULL;
-    chunk->invocations = 0;
+    chunk->last     = NULL;
+    chunk->index    = 0;
+    chunk->line     = 0;
+    chunk->defined  = 0;
     chunk->tangle = 0;
+    chunk->reusable = 0;
     return chunk;
 }
 
-/* http://www.cse.yorku.ca/~oz/hash.html */
-unsigned long hash(unsigned char *str)
+void code_chunk_append(code_chunk * chunk, chunk_contents * c)
+{
+    if (chunk->last == NULL) chunk->contents = c;
+    else chunk->last->successor = c;
+    chunk->last = c;
+}
+typedef struct Region
+{
+    code_chunk * chunk;
+    size_t start;
+    size_t body;
+    size_t end;
+    int line;
+    int end_line;
+    int defines;
+    char atsign;
+    chunk_contents * first;
+    chunk_contents * last;
+} region;
+
+typedef struct RegionMap
+{
+    int record;
+    int keep;
+    region * regions;
+    size_t count;
+    size_t capacity;
+    char * source;
+    size_t length;
+    char * pending;
+    unsigned long rescanned;
+    unsigned long parsed;
+} region_map;
+
+typedef struct CacheEntry
 {
-    unsigned long hash = 5381;
-    int c;
+    int valid;
+    digest sources;
+    digest contents;
+} cache_entry;
 
-    while ((c = *str++)) hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+typedef enum TangleStatus {written, unchanged, skipped} tangle_status;
 
-    return hash;
-}
+typedef struct Tangle
+{
+    code_chunk * chunk;
+    char * path;
+    const char * error;
+    struct CacheEntry * cache;
+    int update;
+    tangle_status status;
+    double seconds;
+    struct Reuse * reuse;
+    const char * linemap;
+} tangle;
+
+typedef struct LineRun
+{
+    unsigned long line;
+    unsigned long source;
+    unsigned long count;
+} line_run;
+
+typedef struct LineMap
+{
+    line_run * runs;
+    size_t count;
+    size_t capacity;
+    unsigned long lines;
+} line_map;
+
+typedef struct Reused
+{
+    code_chunk * chunk;
+    const char * indent;
+    size_t indent_length;
+    const char * string;
+    size_t length;
+    const line_run * runs;
+    size_t run_count;
+    struct Reused * successor;
+} reused;
+
+typedef struct ReusedSources
+{
+    code_chunk * chunk;
+    digest sources;
+    struct ReusedSources * successor;
+} reused_sources;
 
+typedef struct Reuse
+{
+    reused * entries;
+    reused_sources * sources;
+    unsigned long hits;
+    unsigned long misses;
+    pthread_mutex_t lock;
+} reuse;
 typedef struct Dict
 {
-    list ** array;
+    code_chunk ** array;
     size_t size;
+    size_t count;
+    unsigned long lookups;
+    unsigned long probes;
+    unsigned long max_probes;
 } dict;
 
+code_chunk ** dict_slots_new(size_t size)
+{
+    code_chunk ** array = calloc(size, sizeof(code_chunk *));
+    exit_fail_if(array == NULL, "Error: Out of memory\n");
+    return array;
+}
+
 dict * dict_new(size_t size)
 {
     dict * d = malloc(sizeof(dict));
-    d->array = malloc(size * sizeof(list));
-    memset(d->array, (size_t)NULL, size * sizeof(list));
-    d->size = size;
+    exit_fail_if(d == NULL, "Error: Out of memory\n");
+    d->size = 1;
+    while (d->size < size) d->size *= 2;
+    d->array = dict_slots_new(d->size);
+    d->count = 0;
+    d->lookups = 0;
+    d->probes = 0;
+    d->max_probes = 0;
     return d;
 }
 
+void dict_insert(code_chunk ** array, size_t size, code_chunk * c)
+{
+    size_t i = c->hash & (size - 1);
+    while (array[i] != NULL) i = (i + 1) & (size - 1);
+    array[i] = c;
+}
+
 void dict_add(dict * d, code_chunk * c)
 {
-    unsigned long h = hash((unsigned char *)c->name) % d->size;
-    list_push_back(&(d->array[h]), (void *) c);
+    if ((d->count + 1) * 10 > d->size * 7) /* (1) */
+    {
+        size_t i;
+        size_t size = d->size * 2;
+        code_chunk ** array = dict_slots_new(size);
+        for (i = 0; i < d->size; ++i) /* (2) */
+            if (d->array[i] != NULL) dict_insert(array, size, d->array[i]);
+        free(d->array);
+        d->array = array;
+        d->size = size;
+    }
+    c->index = d->count;
+    dict_insert(d->array, d->size, c);
+    d->count += 1;
 }
 
-code_chunk * dict_get(dict * d, char * name)
+code_chunk * dict_get(dict * d, const char * name, size_t length)
 {
-    unsigned long h = hash((unsigned char *)name) % d->size;
-    list * l = d->array[h];
-    while (l != NULL)
+    unsigned long h = hash(name, length);
+    size_t i = h & (d->size - 1);
+    unsigned long probes = 1;
+    code_chunk * c;
+    while ((c = d->array[i]) != NULL)
     {
-        code_chunk * c = l->data;
-        if (strcmp(name, c->name) == 0) return c;
-        else l = l->successor;
+        if (  c->hash == h && c->name_length == length
+           && memcmp(name, c->name, length) == 0
+           ) break;
+        i = (i + 1) & (d->size - 1);
+        ++probes;
     }
-    return NULL;
+    d->lookups += 1;
+    d->probes += probes;
+    if (probes > d->max_probes) d->max_probes = probes;
+    return c;
+}
+
+void dict_clear(dict * d)
+{
+    memset(d->array, 0, d->size * sizeof(code_chunk *));
+    d->count = 0;
+    d->lookups = 0;
+    d->probes = 0;
+    d->max_probes = 0;
+}
+
+void dict_print_stats(FILE * f, dict * d)
+{
+    fprintf(f, "dict: %lu chunks in %lu slots (load factor %.2f)\n"
+           , (unsigned long)d->count, (unsigned long)d->size
+           , (double)d->count / d->size
+           );
+    fprintf(f, "dict: %lu lookups, mean probe length %.2f, max probe length %lu\n"
+           , d->lookups
+           , d->lookups ? (double)d->probes / d->lookups : 0.0
+           , d->max_probes
+           );
+}
+typedef struct Prefix
+{
+    char * string;
+    size_t length;
+    size_t capacity;
+} prefix;
+
+void prefix_reserve(prefix * p, size_t length)
+{
+    if (p->length + length > p->capacity)
+    {
+        while (p->length + length > p->capacity)
+            p->capacity = p->capacity ? p->capacity * 2 : 64;
+        p->string = realloc(p->string, p->capacity);
+        exit_fail_if(p->string == NULL, "Error: Out of memory\n");
+    }
+}
+
+void prefix_append(prefix * p, const char * s, size_t length)
+{
+    if (length == 0) return;
+    prefix_reserve(p, length);
+    memcpy(p->string + p->length, s, length);
+    p->length += length;
+}
+typedef struct Frame
+{
+    code_chunk * chunk;
+    struct ChunkContents * contents;
+    size_t indent;
+    size_t indent_length;
+    size_t first;
+    unsigned long lines;
+    digest outer;
+} frame;
+
+typedef struct Expansion
+{
+    frame * frames;
+    size_t count;
+    size_t capacity;
+} expansion;
+
+void expansion_push(expansion * x, code_chunk * c, size_t indent, size_t indent_length)
+{
+    frame * f;
+    if (x->count == x->capacity)
+    {
+        x->capacity = x->capacity ? x->capacity * 2 : 64;
+        x->frames = realloc(x->frames, x->capacity * sizeof(frame));
+        exit_fail_if(x->frames == NULL, "Error: Out of memory\n");
+    }
+    f = x->frames + x->count++;
+    f->chunk = c;
+    f->contents = c->contents;
+    f->indent = indent;
+    f->indent_length = indent_length;
+    f->first = 0;
+    f->lines = 0;
+}
+typedef struct Output
+{
+    int fd;
+    int failed;
+    char * buffer;
+    size_t used;
+    size_t capacity;
+    unsigned long bytes;
+    unsigned long writes;
+} output;
+
+void output_init(output * o, size_t capacity)
+{
+    o->fd = -1;
+    o->failed = 0;
+    o->buffer = malloc(capacity);
+    exit_fail_if(o->buffer == NULL, "Error: Out of memory\n");
+    o->used = 0;
+    o->capacity = capacity;
+    o->bytes = 0;
+    o->writes = 0;
+}
+
+void output_write_all(output * o, const char * s, size_t length)
+{
+    while (length > 0 && !o->failed)
+    {
+        ssize_t n = write(o->fd, s, length);
+        o->writes += 1;
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) o->failed = 1;
+        else
+        {
+            s += n;
+            length -= n;
+            o->bytes += n;
+        }
+    }
+}
+
+void output_flush(output * o)
+{
+    output_write_all(o, o->buffer, o->used);
+    o->used = 0;
+}
+
+void output_write(output * o, const char * s, size_t length)
+{
+    if (length > o->capacity - o->used && o->fd < 0)
+    {
+        while (length > o->capacity - o->used) o->capacity *= 2; /* (3) */
+        o->buffer = realloc(o->buffer, o->capacity);
+        exit_fail_if(o->buffer == NULL, "Error: Out of memory\n");
+    }
+    if (length > o->capacity - o->used)
+    {
+        output_flush(o); /* (1) */
+        if (length > o->capacity)
+        {
+            output_write_all(o, s, length); /* (2) */
+            return;
+        }
+    }
+    memcpy(o->buffer + o->used, s, length);
+    o->used += length;
+}
+
+void output_free(output * o)
+{
+    free(o->buffer);
+}
+typedef struct Stream
+{
+    int fd;
+    const char * name;
+    char * buffer;
+    size_t used;
+    size_t capacity;
+} source_stream;
+typedef struct Document
+{
+    const char * file;
+    char atsign;
+    int line_number;
+    const char * end_of_source;
+    const char * mapped_source;
+    size_t mapped_size;
+    source_stream stream;
+    region_map regions;
+    arena memory;
+    dict * chunks;
+    list * tangles;
+    reuse reuse;
+    int snapshot;
+} document;
+typedef enum StatsFormat {no_stats, text_stats, json_stats} stats_format;
+
+typedef struct RunTimes
+{
+    double started;
+    double loaded;
+    double parsed;
+    double resolved;
+    double tangled;
+} run_times;
+
+pthread_key_t recovery;
+
+void give_up(void)
+{
+    jmp_buf * r = pthread_getspecific(recovery);
+    if (r != NULL) longjmp(*r, 1);
+    exit(EXIT_FAILURE);
 }
 
 void exit_fail_if(int condition, char * message, ...)
@@ -189,13 +646,19 @@ void exit_fail_if(int condition, char * message, ...)
     va_start(args, message);
     vfprintf(stderr, message, args);
     va_end(args);
-    exit(EXIT_FAILURE);
+    give_up();
+}
+double seconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
 }
-char * extract_name(char ** source)
+const char * extract_name(document * doc, const char ** source, size_t * length)
 {
-    char * s = *source;
+    const char * s = *source;
     char terminus = *s++;
-    char * destination = s;
+    const char * destination = s;
 
     switch (terminus)
     {
@@ -205,118 +668,2594 @@ char * extract_name(char ** source)
         case '<': terminus = '>'; break;
     }
 
-    for (; *s != terminus; ++s)
-        exit_fail_if ( (*s == '\n' || *s == '\0')
+    for (; s == doc->end_of_source || *s != terminus; ++s)
+        exit_fail_if ( (s == doc->end_of_source || *s == '\n')
                      , "Error: Unterminated name on line %d\n"
-                     , line_number
+                     , doc->line_number
                      );
     exit_fail_if ( destination == s
                  , "Error: Empty name on line %d\n"
-                 , line_number
+                 , doc->line_number
                  );
 
-    *s = '\0';
+    *length = s - destination;
     *source = s + 1;
     return destination;
 }
-int advance_to_next_line(char ** source)
+int advance_to_next_line(document * doc, const char ** source)
 {
-    char * s = *source;
-    while (*s != '\n') if (*s++ == '\0') return 0;
+    const char * s = memchr(*source, '\n', doc->end_of_source - *source);
+    if (s == NULL) return 0;
     *source = s + 1;
-    ++line_number;
+    ++doc->line_number;
     return 1;
 }
-void code_chunk_print(FILE * f, dict * d, code_chunk * c, list * indents, int tangle)
-{
-    list * l;
+#define ONES (~0UL / 255)
+#define HIGHS (ONES * 128)
 
-    if (c->invocations != 0)
+unsigned long byte_mask(unsigned long word, char c)
+{
+    unsigned long lows = ~HIGHS;
+    unsigned long x = word ^ (ONES * (unsigned char)c); /* (1) */
+    return ~(((x & lows) + lows) | x | lows);
+}
+size_t count_newlines(const char * s, const char * end)
+{
+    size_t count = 0;
+    unsigned long word;
+    for (; end - s >= (ptrdiff_t)sizeof word; s += sizeof word) /* (1) */
     {
-        if (c->invocations == 1)
-            exit_fail_if(1, "Error: Ignoring multiple invocations of chunk %s.\n"
-                        , c->name
-                        );
-        c->invocations += 1;
-        return;
+        memcpy(&word, s, sizeof word);
+        count += ((byte_mask(word, '\n') >> 7) * ONES) >> (8 * (sizeof word - 1)); /* (2) */
     }
-    else if (c->tangle)
+    for (; s < end; ++s) count += *s == '\n'; /* (3) */
+    return count;
+}
+const char * find_line_end(document * doc, const char * s)
+{
+    unsigned long word;
+    for (; doc->end_of_source - s >= (ptrdiff_t)sizeof word; s += sizeof word) /* (1) */
     {
-        if (tangle) c->invocations = 1;
-        else
+        memcpy(&word, s, sizeof word);
+        if (byte_mask(word, '\n') | byte_mask(word, doc->atsign)) break;
+    }
+    for (; s < doc->end_of_source; ++s) /* (2) */
+        if (*s == '\n' || *s == doc->atsign) break;
+    return s;
+}
+int source_refill(document * doc, const char ** s)
+{
+    const char * line_end = NULL;
+    size_t consumed;
+    ssize_t n = 1;
+
+    if (doc->stream.fd < 0) return 0;
+    consumed = doc->end_of_source - doc->stream.buffer;
+    doc->stream.used -= consumed;
+    if (doc->stream.used != 0) /* (1) */
+        memmove(doc->stream.buffer, doc->end_of_source, doc->stream.used);
+    while (line_end == NULL && n > 0) /* (2) */
+    {
+        size_t scanned = doc->stream.used;
+        if (doc->stream.used == doc->stream.capacity) /* (3) */
         {
-            exit_fail_if(1
-                        , "Error: Ignoring invocation of tangle chunk %s within "
-                          "another chunk.\n"
-                        , c->name
-                        );
-            return;
+            doc->stream.capacity = doc->stream.capacity ? doc->stream.capacity * 2 : 1 << 16;
+            doc->stream.buffer = realloc(doc->stream.buffer, doc->stream.capacity);
+            exit_fail_if(doc->stream.buffer == NULL, "Error: Out of memory\n");
         }
+        n = read(doc->stream.fd, doc->stream.buffer + doc->stream.used, doc->stream.capacity - doc->stream.used);
+        exit_fail_if ( (n < 0)
+                     , "Error: Could not read source file %s\n", doc->stream.name
+                     );
+        doc->stream.used += n;
+        for (line_end = doc->stream.buffer + doc->stream.used; line_end != doc->stream.buffer + scanned; --line_end)
+            if (line_end[-1] == '\n') break;
+        if (line_end == doc->stream.buffer + scanned) line_end = NULL;
     }
-    else c->invocations = 1;
-
-    for (l = c->contents; l != NULL; l = l->successor)
+    doc->end_of_source = line_end != NULL ? line_end : doc->stream.buffer + doc->stream.used; /* (4) */
+    *s = doc->stream.buffer;
+    return doc->end_of_source != doc->stream.buffer;
+}
+const char * source_keep(document * doc, const char * s, size_t length)
+{
+    if (doc->stream.fd < 0 && !doc->regions.keep) return s;
+    return arena_strndup(&doc->memory, s, length);
+}
+void source_close(document * doc)
+{
+    if (doc->stream.fd >= 0) close(doc->stream.fd);
+    free(doc->stream.buffer);
+    doc->stream.fd = -1;
+    doc->stream.buffer = NULL;
+    doc->stream.used = 0;
+    doc->stream.capacity = 0;
+}
+const char * parse_chunk(document * doc, code_chunk * chunk, const char * s)
+{
     {
-        chunk_contents * contents = l->data;
-        if (contents_type(contents) == code)
+        const char * start_of_line = s; /* (1) */
+        for (;;)
         {
-            if (*contents->string != '\0') /* (1) */
+            if (s == doc->end_of_source && source_refill(doc, &s)) start_of_line = s; /* (5) */
+            s = find_line_end(doc, s); /* (2) */
+            exit_fail_if(s == doc->end_of_source /* (4) */
+                        , "Error: File ended during definition of chunk %.*s"
+                        , (int)chunk->name_length, chunk->name
+                        );
+            if (*s == '\n') /* (2.a) */
+            {
+                chunk_contents * full_line = code_contents_new(&doc->memory, source_keep(doc, start_of_line, s - start_of_line + 1), s - start_of_line, doc->line_number); /* (1) */
+                code_chunk_append(chunk, full_line); /* (2) */
+                ++doc->line_number; /* (3) */
+                ++s; /* (4) */
+                start_of_line = s; /* (3.a) */
+            }
+            else if (*s == doc->atsign) /* (2.b) */
             {
-                /* print indents on non-empty lines */
-                list * i;
-                for (i = indents; i != NULL; i = i->successor)
+                ++s;
+                exit_fail_if(s == doc->end_of_source
+                            , "Error: File ended during definition of chunk %.*s"
+                            , (int)chunk->name_length, chunk->name
+                            );
+                if (*s == '/')
                 {
-                    fputs((char *)i->data, f);
+                    if (!advance_to_next_line(doc, &s)) s = doc->end_of_source;
+                    break;
                 }
-                fputs(contents->string, f); 
-            }
+                else if (*s == '{')
+                {
+                    code_chunk * ref;
+                    const char * indent = start_of_line; /* (1.a) */
+                    size_t indent_length = (s - 1) - start_of_line; /* (1.b) */
+                    int line = doc->line_number;
+
+                    {
+                        size_t name_length;
+                        const char * name = extract_name(doc, &s, &name_length); /* (2.a) */
+                        ref = dict_get(doc->chunks, name, name_length); /* (2.b) */
+                        if (ref == NULL) /* chunk hasn't been defined yet */
+                        {
+                            ref = code_chunk_new(&doc->memory, source_keep(doc, name, name_length), name_length); /* (2.c) */
+                            dict_add(doc->chunks, ref);
+                        }
+                        exit_fail_if(!advance_to_next_line(doc, &s) /* (4) */
+                                    , "Error: File ended during definition of chunk '%.*s'\n"
+                                      "       following invocation of chunk '%.*s' on line '%d'\n"
+                                    , (int)chunk->name_length, chunk->name
+                                    , (int)name_length, name, doc->line_number
+                                    );
+                    }
 
+                    code_chunk_append(chunk, reference_contents_new(&doc->memory, source_keep(doc, indent, indent_length), indent_length, ref, line)); /* (3) */
+                }
+                else if (*s == doc->atsign)
+                {
+                    const char * at_the_atsign = s - 1;
+                    const char * ending = s;
+                    size_t beginning_length = at_the_atsign - start_of_line;
+                    chunk_contents * beginning_part = code_contents_new(&doc->memory, source_keep(doc, start_of_line, beginning_length), beginning_length, doc->line_number);
+                    chunk_contents * ending_part;
 
-            if (contents->partial_line) /* (2) TODO should this be while? */
-            {
-                l = l->successor;
-                exit_fail_if(l == NULL
-                            , "Error: Partial line without successor in chunk '%s':\n"
-                              "       %s"
-                            , c->name, contents->string
-                            );
-                contents = l->data;
-                fputs(contents->string, f);
-            }
+                    exit_fail_if(!advance_to_next_line(doc, &s)
+                            , "Error: File ended during definition of chunk '%.*s'\n"
+                              "       following the escape sequence on line '%d'\n"
+                            , (int)chunk->name_length, chunk->name, doc->line_number);
+
+                    /* (1) */
+                    ending_part = code_contents_new(&doc->memory, source_keep(doc, ending, s - ending), (s - 1) - ending, beginning_part->line); /* s - 1 points to a newline character */
 
-            fputc('\n', f); /* (3) */
+                    beginning_part->partial_line = 1; /* (2) */
+
+                    code_chunk_append(chunk, beginning_part);
+                    code_chunk_append(chunk, ending_part);
+                }
+                else /* (3.c) */
+                {
+                    exit_fail_if(1, "Error: Unrecognized control sequence ATSIGN%c "
+                                    "while parsing chunk on line %d\n"
+                                , *s, doc->line_number
+                                );
+                    continue; /* (3.d) */
+                }
+                start_of_line = s; /* (3.b) */
+            }
         }
-        else if (contents_type(contents) == reference)
+    }
+    return s;
+}
+
+void region_add( document * doc, code_chunk * chunk, const char * source, const char * at
+               , const char * body, const char * end, int line
+               , chunk_contents * previous
+               )
+{
+    region * r;
+    if (doc->regions.count == doc->regions.capacity)
+    {
+        doc->regions.capacity = doc->regions.capacity ? doc->regions.capacity * 2 : 256;
+        doc->regions.regions = realloc(doc->regions.regions, doc->regions.capacity * sizeof(region));
+        exit_fail_if(doc->regions.regions == NULL, "Error: Out of memory\n");
+    }
+    r = doc->regions.regions + doc->regions.count++;
+    r->chunk = chunk;
+    r->start = r->body = r->end = 0;
+    if (doc->stream.fd < 0) /* (3) */
+    {
+        while (at > source && at[-1] != '\n') --at; /* (1) */
+        r->start = at - source;
+        r->body = body - source;
+        r->end = end - source;
+    }
+    r->line = line;
+    r->end_line = doc->line_number;
+    r->defines = chunk != NULL && chunk->line == line - 1;
+    r->atsign = doc->atsign;
+    r->first = NULL;
+    r->last = NULL;
+    if (chunk != NULL && chunk->last != previous) /* (2) */
+    {
+        r->first = previous != NULL ? previous->successor : chunk->contents;
+        r->last = chunk->last;
+    }
+}
+
+void region_map_keep(document * doc, const char * source, size_t length)
+{
+    free(doc->regions.source);
+    doc->regions.source = malloc(length + 1);
+    exit_fail_if(doc->regions.source == NULL, "Error: Out of memory\n");
+    memcpy(doc->regions.source, source, length);
+    doc->regions.length = length;
+    doc->regions.rescanned = length;
+    doc->regions.parsed = doc->memory.bytes;
+}
+
+void region_map_clear(document * doc)
+{
+    free(doc->regions.source);
+    free(doc->regions.pending);
+    doc->regions.source = NULL;
+    doc->regions.pending = NULL;
+    doc->regions.length = 0;
+    doc->regions.count = 0;
+}
+void region_relink(document * doc, code_chunk * c)
+{
+    chunk_contents * last = NULL;
+    size_t i;
+    c->contents = NULL;
+    for (i = 0; i < doc->regions.count; ++i)
+    {
+        region * r = doc->regions.regions + i;
+        if (r->chunk != c || r->first == NULL) continue;
+        if (last == NULL) c->contents = r->first;
+        else last->successor = r->first;
+        last = r->last;
+    }
+    if (last != NULL) last->successor = NULL;
+    c->last = last;
+}
+
+char * read_file(const char * path, size_t * length)
+{
+    struct stat st;
+    char * buffer = NULL;
+    size_t used = 0;
+    ssize_t n = 1;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        buffer = malloc(st.st_size + 1);
+        while (buffer != NULL && used < (size_t)st.st_size && n > 0)
         {
-            code_chunk * next_c = contents->reference;
-            list_push_back(&indents, (void *)contents->string);
-            code_chunk_print(f, d, next_c, indents, 0);
-            list_pop_back(&indents);
+            n = read(fd, buffer + used, st.st_size - used);
+            if (n < 0 && errno == EINTR) n = 1;
+            else if (n > 0) used += n;
         }
     }
+    close(fd);
+    if (buffer != NULL && n < 0)
+    {
+        free(buffer);
+        buffer = NULL;
+    }
+    *length = used;
+    return buffer;
+}
+size_t line_start(const char * source, size_t i)
+{
+    while (i > 0 && source[i - 1] != '\n') --i;
+    return i;
 }
 
-const char * help =
-"lili: the little literate programming tool -- version %s\n\
-\n\
-    USAGE: %s file\n\
-\n\
-    lili extracts machine source code from literate source code.\n\
-\n\
-All control sequences begin with a special character called ATSIGN, which is \n\
-set to '@' by default. Except for escaped ATSIGNs, all control sequences consume\n\
-(i.e. cause to be ignored) the remainder of the line following the end of the\n\
-control sequence.\n\
-\n\
-ATSIGN:new control character  Redefines ATSIGN to whatever immediately follows\n\
-                              the : sign. This is useful if your machine source\n\
-                              language uses lots of @ signs, for example. This\n\
-                              control sequence is ignored if it occurs inside\n\
-                              a code chunk definition.\n\
-\n\
-ATSIGN='chunk name'           Begin a regular chunk definition. The chunk name\n\
-                              must be surrounded by matching single (') or\n\
-                              double (\") quotes (no backticks). The chunk\n\
+size_t line_end(const char * source, size_t length, size_t i)
+{
+    const char * end = memchr(source + i, '\n', length - i);
+    return end == NULL ? length : (size_t)(end - source) + 1;
+}
+
+int reparse(document * doc, double * loaded)
+{
+    char * old = doc->regions.source;
+    size_t old_length = doc->regions.length;
+    char * new;
+    size_t new_length, common, prefix = 0, suffix = 0, old_end, new_end, k;
+    int lines;
+    region * r;
+
+    free(doc->regions.pending);
+    doc->regions.pending = NULL;
+    if (old == NULL) return 0;
+    if (doc->memory.bytes > 2 * doc->regions.parsed) return 0; /* (12) */
+    new = read_file(doc->file, &new_length);
+    if (new == NULL) return 0;
+    *loaded = seconds();
+    doc->regions.pending = new;
+
+    common = old_length < new_length ? old_length : new_length;
+    while (prefix + 4096 <= common && memcmp(old + prefix, new + prefix, 4096) == 0)
+        prefix += 4096; /* (1) */
+    while (prefix < common && old[prefix] == new[prefix]) ++prefix;
+    common -= prefix;
+    while (  suffix + 4096 <= common
+          && memcmp(old + old_length - suffix - 4096, new + new_length - suffix - 4096, 4096) == 0
+          ) suffix += 4096; /* (2) */
+    while (  suffix < common
+          && old[old_length - suffix - 1] == new[new_length - suffix - 1]
+          ) ++suffix;
+    old_end = old_length - suffix;
+    new_end = new_length - suffix;
+    if (old_end == prefix && new_end == prefix) return 1;
+
+    for (k = 0; k < doc->regions.count && doc->regions.regions[k].end <= prefix; ++k);
+    r = doc->regions.regions + k;
+    if (k == doc->regions.count || old_end <= r->start) /* (3) */
+    {
+        char atsign = k == 0 ? '@' : r[-1].atsign;
+        size_t old_first = line_start(old, prefix);
+        size_t new_first = line_start(new, prefix);
+        size_t old_last = line_end(old, old_length, old_end > prefix ? old_end - 1 : prefix);
+        size_t new_last = line_end(new, new_length, new_end > prefix ? new_end - 1 : prefix);
+        if (  memchr(old + old_first, atsign, old_last - old_first) != NULL /* (4) */
+           || memchr(new + new_first, atsign, new_last - new_first) != NULL
+           ) return 0;
+        lines = count_newlines(new + prefix, new + new_end)
+              - count_newlines(old + prefix, old + old_end);
+        doc->regions.rescanned = new_last - new_first;
+    }
+    else if (r->chunk != NULL && prefix >= r->body && old_end < r->end) /* (5) */
+    {
+        code_chunk scratch = *r->chunk;
+        const char * s;
+        chunk_contents * c;
+        size_t end = r->end + new_length - old_length;
+        for (c = r->first; c != NULL; c = c == r->last ? NULL : c->successor)
+            if (contents_type(c) == reference && !c->reference->defined) return 0; /* (13) */
+        scratch.contents = NULL;
+        scratch.last = NULL;
+        doc->line_number = r->line; /* (6) */
+        doc->atsign = r->atsign;
+        doc->end_of_source = new + new_length;
+        s = parse_chunk(doc, &scratch, new + r->body); /* (7) */
+        if ((size_t)(s - new) != end) return 0; /* (8) */
+        lines = count_newlines(new + r->body, new + end)
+              - count_newlines(old + r->body, old + r->end);
+        r->first = scratch.contents; /* (9) */
+        r->last = scratch.last;
+        r->end = end;
+        r->end_line = doc->line_number;
+        region_relink(doc, r->chunk);
+        doc->regions.rescanned = end - r->body;
+        ++k;
+    }
+    else return 0;
+
+    for (; k < doc->regions.count; ++k) /* (10) */
+    {
+        chunk_contents * c;
+        r = doc->regions.regions + k;
+        r->start += new_length - old_length;
+        r->body += new_length - old_length;
+        r->end += new_length - old_length;
+        if (r->defines) r->chunk->line += lines;
+        r->line += lines;
+        r->end_line += lines;
+        for (c = lines != 0 ? r->first : NULL; c != NULL; c = c == r->last ? NULL : c->successor)
+            c->line += lines;
+    }
+    free(old); /* (11) */
+    doc->regions.source = new;
+    doc->regions.length = new_length;
+    doc->regions.pending = NULL;
+    return 1;
+}
+
+typedef struct SnapshotHeader
+{
+    char magic[8];
+    unsigned long layout;
+    unsigned long source_size;
+    unsigned long source_hash;
+    unsigned long source_inode;
+    long source_time;
+    unsigned long chunks;
+    unsigned long contents;
+    unsigned long tangles;
+    unsigned long regions;
+    unsigned long strings;
+} snapshot_header;
+
+typedef struct SnapshotChunk
+{
+    unsigned long name;
+    unsigned long name_length;
+    unsigned long hash;
+    unsigned long contents;
+    unsigned long count;
+    int line;
+    int defined;
+    int tangle;
+    int reusable;
+} snapshot_chunk;
+
+typedef struct SnapshotContents
+{
+    unsigned long string;
+    unsigned long length;
+    unsigned long reference;
+    int partial_line;
+    int line;
+} snapshot_contents;
+
+typedef struct SnapshotRegion
+{
+    unsigned long chunk;
+    unsigned long count;
+    unsigned long start;
+    unsigned long body;
+    unsigned long end;
+    int line;
+    int end_line;
+    char atsign;
+} snapshot_region;
+
+#define SNAPSHOT_NONE (~0UL)
+#define SNAPSHOT_VERSION 2
+
+unsigned long snapshot_layout(void)
+{
+    return SNAPSHOT_VERSION + 16 * ( sizeof(snapshot_header) + (sizeof(snapshot_chunk) << 8) /* (1) */
+                                   + (sizeof(snapshot_contents) << 16) + (sizeof(snapshot_region) << 24)
+                                   );
+}
+unsigned long source_hash(const char * s, size_t length)
+{
+    unsigned long h = length, word;
+    size_t i;
+    for (i = 0; i + sizeof(word) <= length; i += sizeof(word))
+    {
+        memcpy(&word, s + i, sizeof(word));
+        h = (h ^ word) * 2654435761UL;
+        h ^= h >> 15;
+    }
+    for (; i < length; ++i) h = (h ^ (unsigned char)s[i]) * 2654435761UL;
+    return h;
+}
+unsigned long snapshot_string_length(chunk_contents * c)
+{
+    return c->length + (contents_type(c) == code && !c->partial_line);
+}
+
+void snapshot_write(const char * path, document * doc)
+{
+    dict * d = doc->chunks;
+    code_chunk ** chunks;
+    chunk_contents * c;
+    snapshot_header h;
+    unsigned long strings = 0, contents = 0;
+    size_t i;
+    char * temporary;
+    FILE * f;
+    list * l;
+    struct stat st;
+
+    if (doc->mapped_source == NULL) return;
+    chunks = calloc(d->count + 1, sizeof(code_chunk *));
+    temporary = malloc(strlen(path) + 5);
+    exit_fail_if(chunks == NULL || temporary == NULL, "Error: Out of memory\n");
+    for (i = 0; i < d->size; ++i) /* (1) */
+        if (d->array[i] != NULL) chunks[d->array[i]->index] = d->array[i];
+    sprintf(temporary, "%s.tmp", path);
+    f = fopen(temporary, "wb");
+    exit_fail_if(f == NULL, "Error: Failed to open snapshot file '%s'\n", temporary);
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "lilisnap", 8);
+    h.layout = snapshot_layout();
+    h.source_size = doc->mapped_size;
+    h.source_hash = source_hash(doc->mapped_source, doc->mapped_size);
+    if (stat(doc->file, &st) == 0)
+    {
+        h.source_inode = st.st_ino;
+        h.source_time = st.st_mtime;
+    }
+    h.chunks = d->count;
+    for (l = doc->tangles; l != NULL; l = l->successor) ++h.tangles;
+    h.regions = doc->regions.count;
+    for (i = 0; i < d->count; ++i)
+    {
+        h.strings += chunks[i]->name_length;
+        for (c = chunks[i]->contents; c != NULL; c = c->successor)
+        {
+            h.contents += 1;
+            h.strings += snapshot_string_length(c);
+        }
+    }
+    fwrite(&h, sizeof(h), 1, f);
+
+    for (i = 0; i < d->count; ++i)
+    {
+        snapshot_chunk r;
+        memset(&r, 0, sizeof(r));
+        r.name = strings; /* (2) */
+        r.name_length = chunks[i]->name_length;
+        r.hash = chunks[i]->hash;
+        r.contents = contents;
+        for (c = chunks[i]->contents; c != NULL; c = c->successor) ++r.count;
+        r.line = chunks[i]->line;
+        r.defined = chunks[i]->defined;
+        r.tangle = chunks[i]->tangle;
+        r.reusable = chunks[i]->reusable;
+        strings += r.name_length;
+        contents += r.count;
+        fwrite(&r, sizeof(r), 1, f);
+    }
+    for (i = 0; i < d->count; ++i)
+        for (c = chunks[i]->contents; c != NULL; c = c->successor)
+        {
+            snapshot_contents r;
+            memset(&r, 0, sizeof(r));
+            r.string = strings; /* (3) */
+            r.length = c->length;
+            r.reference = c->reference != NULL ? c->reference->index : SNAPSHOT_NONE;
+            r.partial_line = c->partial_line;
+            r.line = c->line;
+            strings += snapshot_string_length(c);
+            fwrite(&r, sizeof(r), 1, f);
+        }
+    for (l = doc->tangles; l != NULL; l = l->successor)
+    {
+        unsigned long index = ((code_chunk *)l->data)->index;
+        fwrite(&index, sizeof(index), 1, f);
+    }
+    for (i = 0; i < doc->regions.count; ++i)
+    {
+        region * g = doc->regions.regions + i;
+        snapshot_region r;
+        memset(&r, 0, sizeof(r));
+        r.chunk = g->chunk != NULL ? g->chunk->index : SNAPSHOT_NONE;
+        for (c = g->first; c != NULL; c = c == g->last ? NULL : c->successor) ++r.count;
+        r.start = g->start;
+        r.body = g->body;
+        r.end = g->end;
+        r.line = g->line;
+        r.end_line = g->end_line;
+        r.atsign = g->atsign;
+        fwrite(&r, sizeof(r), 1, f);
+    }
+    for (i = 0; i < d->count; ++i)
+        fwrite(chunks[i]->name, 1, chunks[i]->name_length, f);
+    for (i = 0; i < d->count; ++i)
+        for (c = chunks[i]->contents; c != NULL; c = c->successor)
+            fwrite(c->string, 1, snapshot_string_length(c), f);
+
+    exit_fail_if(ferror(f) || fclose(f) != 0 || rename(temporary, path) != 0
+                , "Error: Failed to write snapshot file '%s'\n", path
+                );
+    free(temporary);
+    free(chunks);
+}
+int snapshot_source_matches(const char * file, const snapshot_header * h, struct stat * snapshot)
+{
+    struct stat st;
+    void * map;
+    int matches = 0;
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) return 0;
+    if (  fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0
+       && (unsigned long)st.st_size == h->source_size /* (1) */
+       )
+    {
+        if (  (unsigned long)st.st_ino == h->source_inode /* (2.a) */
+           && (long)st.st_mtime == h->source_time /* (2.b) */
+           && (long)snapshot->st_mtime > h->source_time /* (2.c) */
+           )
+        {
+            close(fd);
+            return 1;
+        }
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            matches = source_hash(map, st.st_size) == h->source_hash; /* (3) */
+            munmap(map, st.st_size);
+        }
+    }
+    close(fd);
+    return matches;
+}
+int snapshot_read_chunks( document * doc, const snapshot_header * h
+                        , code_chunk * chunks, chunk_contents * contents
+                        )
+{
+    const snapshot_chunk * records = (const snapshot_chunk *)(h + 1);
+    const snapshot_contents * contents_records = (const snapshot_contents *)(records + h->chunks);
+    const unsigned long * tangles = (const unsigned long *)(contents_records + h->contents);
+    const char * strings = (const char *)h + doc->mapped_size - h->strings;
+    unsigned long i, j;
+
+    for (i = 0; i < h->chunks; ++i) /* (1) */
+    {
+        const snapshot_chunk * r = records + i;
+        code_chunk * c = chunks + i;
+        if (  r->name > h->strings || r->name_length > h->strings - r->name /* (2) */
+           || r->contents > h->contents || r->count > h->contents - r->contents
+           ) return 0;
+        c->name = strings + r->name;
+        c->name_length = r->name_length;
+        c->hash = r->hash;
+        c->contents = r->count != 0 ? contents + r->contents : NULL;
+        c->last = r->count != 0 ? contents + r->contents + r->count - 1 : NULL;
+        c->line = r->line;
+        c->defined = r->defined;
+        c->tangle = r->tangle;
+        c->reusable = r->reusable;
+        dict_add(doc->chunks, c);
+        for (j = r->contents; j < r->contents + r->count; ++j)
+            contents[j].successor = j + 1 < r->contents + r->count ? contents + j + 1 : NULL;
+    }
+    for (i = 0; i < h->contents; ++i)
+    {
+        const snapshot_contents * r = contents_records + i;
+        chunk_contents * c = contents + i;
+        if (r->reference != SNAPSHOT_NONE && r->reference >= h->chunks) return 0; /* (2) */
+        c->length = r->length;
+        c->partial_line = r->partial_line;
+        c->line = r->line;
+        c->reference = r->reference == SNAPSHOT_NONE ? NULL : chunks + r->reference;
+        if (r->string > h->strings || snapshot_string_length(c) > h->strings - r->string)
+            return 0;
+        c->string = strings + r->string;
+    }
+    for (i = h->tangles; i-- > 0;) /* (3) */
+    {
+        if (tangles[i] >= h->chunks || !chunks[tangles[i]].tangle) return 0; /* (2) */
+        list_push(&doc->memory, &doc->tangles, chunks + tangles[i]);
+    }
+    return 1;
+}
+
+int snapshot_read_regions( document * doc, const snapshot_header * h
+                         , code_chunk * chunks, chunk_contents * contents
+                         )
+{
+    const snapshot_chunk * records = (const snapshot_chunk *)(h + 1);
+    const snapshot_region * regions = (const snapshot_region *)
+        ( (const char *)(records + h->chunks) + h->contents * sizeof(snapshot_contents)
+        + h->tangles * sizeof(unsigned long)
+        );
+    size_t * next = malloc((h->chunks + 1) * sizeof(size_t));
+    unsigned long i;
+
+    doc->regions.regions = realloc(doc->regions.regions, (h->regions + 1) * sizeof(region));
+    exit_fail_if(next == NULL || doc->regions.regions == NULL, "Error: Out of memory\n");
+    doc->regions.capacity = h->regions + 1;
+    for (i = 0; i < h->chunks; ++i) next[i] = records[i].contents;
+    for (i = 0; i < h->regions; ++i)
+    {
+        const snapshot_region * r = regions + i;
+        region * g = doc->regions.regions + i;
+        if (  (r->chunk != SNAPSHOT_NONE && r->chunk >= h->chunks) /* (2) */
+           || (r->count != 0 && r->chunk == SNAPSHOT_NONE)
+           || (r->count != 0 && r->count > records[r->chunk].contents + records[r->chunk].count - next[r->chunk])
+           ) break;
+        g->chunk = r->chunk == SNAPSHOT_NONE ? NULL : chunks + r->chunk;
+        g->first = g->last = NULL;
+        if (r->count != 0) /* (4) */
+        {
+            g->first = contents + next[r->chunk];
+            g->last = contents + next[r->chunk] + r->count - 1;
+            next[r->chunk] += r->count;
+        }
+        g->start = r->start;
+        g->body = r->body;
+        g->end = r->end;
+        g->line = r->line;
+        g->end_line = r->end_line;
+        g->defines = g->chunk != NULL && g->chunk->line == g->line - 1;
+        g->atsign = r->atsign;
+        doc->regions.count = i + 1;
+    }
+    free(next);
+    return i == h->regions;
+}
+
+int snapshot_read(document * doc, const snapshot_header * h)
+{
+    code_chunk * chunks = arena_alloc(&doc->memory, (h->chunks + 1) * sizeof(code_chunk));
+    chunk_contents * contents = arena_alloc(&doc->memory, (h->contents + 1) * sizeof(chunk_contents));
+    if (  !snapshot_read_chunks(doc, h, chunks, contents)
+       || !snapshot_read_regions(doc, h, chunks, contents)
+       ) return 0;
+    doc->snapshot = 1;
+    return 1;
+}
+int snapshot_load(const char * path, document * doc, double * loaded)
+{
+    struct stat st;
+    const snapshot_header * h;
+    unsigned long size;
+    void * map;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(snapshot_header))
+    {
+        close(fd);
+        return 0;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+    h = map;
+    size = (unsigned long)st.st_size;
+    if (  memcmp(h->magic, "lilisnap", 8) != 0 || h->layout != snapshot_layout() /* (1) */
+       || h->chunks > size || h->contents > size || h->tangles > size
+       || h->regions > size || h->strings > size
+       || size != sizeof(snapshot_header) /* (3) */
+                 + h->chunks * sizeof(snapshot_chunk) + h->contents * sizeof(snapshot_contents)
+                 + h->tangles * sizeof(unsigned long) + h->regions * sizeof(snapshot_region)
+                 + h->strings
+       || !snapshot_source_matches(doc->file, h, &st) /* (2) */
+       )
+    {
+        munmap(map, st.st_size);
+        return 0;
+    }
+    *loaded = seconds();
+    doc->mapped_source = map; /* (4) */
+    doc->mapped_size = st.st_size;
+    return snapshot_read(doc, h);
+}
+
+void line_map_add(line_map * m, unsigned long source, unsigned long count)
+{
+    line_run * last = m->count != 0 ? m->runs + m->count - 1 : NULL;
+    if (last != NULL && last->source + last->count == source) last->count += count; /* (1) */
+    else
+    {
+        if (m->count == m->capacity)
+        {
+            m->capacity = m->capacity ? m->capacity * 2 : 256;
+            m->runs = realloc(m->runs, m->capacity * sizeof(line_run));
+            exit_fail_if(m->runs == NULL, "Error: Out of memory\n");
+        }
+        last = m->runs + m->count++;
+        last->line = m->lines;
+        last->source = source;
+        last->count = count;
+    }
+    m->lines += count;
+}
+
+typedef struct Emit
+{
+    size_t indent;
+    size_t indent_length;
+    const char * string;
+    size_t length;
+} emit;
+
+typedef struct Plan
+{
+    emit * emits;
+    size_t count;
+    size_t capacity;
+    prefix indents;
+    expansion stack;
+    struct Reuse * reuse;
+    line_map lines;
+} plan;
+
+void plan_add( plan * p, size_t indent, size_t indent_length
+             , const char * string, size_t length
+             )
+{
+    emit * e;
+    if (p->count == p->capacity)
+    {
+        p->capacity = p->capacity ? p->capacity * 2 : 1024;
+        p->emits = realloc(p->emits, p->capacity * sizeof(emit));
+        exit_fail_if(p->emits == NULL, "Error: Out of memory\n");
+    }
+    e = p->emits + p->count++;
+    e->indent = indent;
+    e->indent_length = indent_length;
+    e->string = string;
+    e->length = length;
+}
+
+void plan_free(plan * p)
+{
+    free(p->emits);
+    free(p->indents.string);
+    free(p->stack.frames);
+    free(p->lines.runs);
+}
+
+const reused * reuse_find( reuse * r, code_chunk * c
+                         , const char * indent, size_t indent_length
+                         )
+{
+    reused * e;
+    pthread_mutex_lock(&r->lock);
+    for (e = r->entries; e != NULL; e = e->successor)
+        if (  e->chunk == c && e->indent_length == indent_length
+           && memcmp(e->indent, indent, indent_length) == 0
+           ) break;
+    if (e != NULL) r->hits += 1;
+    else r->misses += 1;
+    pthread_mutex_unlock(&r->lock);
+    return e;
+}
+void reuse_add(plan * p, frame * f)
+{
+    size_t length = 0, k = p->lines.count, i;
+    const emit * e;
+    const emit * end = p->emits + p->count;
+    reused * entry;
+    line_run * runs;
+    char * s;
+
+    for (e = p->emits + f->first; e != end; ++e) /* (1) */
+        length += e->indent_length + e->length;
+    while (k > 0 && p->lines.runs[k - 1].line + p->lines.runs[k - 1].count > f->lines) --k; /* (3) */
+    entry = malloc(sizeof(reused) + (p->lines.count - k) * sizeof(line_run) + f->indent_length + length);
+    exit_fail_if(entry == NULL, "Error: Out of memory\n");
+    entry->runs = runs = (line_run *)(entry + 1);
+    entry->run_count = p->lines.count - k;
+    for (i = 0; i < entry->run_count; ++i)
+    {
+        runs[i] = p->lines.runs[k + i];
+        if (runs[i].line < f->lines)
+        {
+            runs[i].source += f->lines - runs[i].line;
+            runs[i].count -= f->lines - runs[i].line;
+            runs[i].line = f->lines;
+        }
+        runs[i].line -= f->lines; /* (4) */
+    }
+    s = (char *)(runs + entry->run_count); /* (2) */
+    memcpy(s, p->indents.string + f->indent, f->indent_length);
+    entry->chunk = f->chunk;
+    entry->indent = s;
+    entry->indent_length = f->indent_length;
+    entry->string = s += f->indent_length;
+    entry->length = length;
+    for (e = p->emits + f->first; e != end; ++e)
+    {
+        memcpy(s, p->indents.string + e->indent, e->indent_length);
+        memcpy(s += e->indent_length, e->string, e->length);
+        s += e->length;
+    }
+
+    pthread_mutex_lock(&p->reuse->lock);
+    entry->successor = p->reuse->entries;
+    p->reuse->entries = entry;
+    pthread_mutex_unlock(&p->reuse->lock);
+}
+int reuse_find_sources(reuse * r, code_chunk * c, digest * sources)
+{
+    reused_sources * e;
+    pthread_mutex_lock(&r->lock);
+    for (e = r->sources; e != NULL; e = e->successor)
+        if (e->chunk == c) break;
+    if (e != NULL) *sources = e->sources;
+    pthread_mutex_unlock(&r->lock);
+    return e != NULL;
+}
+
+void reuse_add_sources(reuse * r, code_chunk * c, digest * sources)
+{
+    reused_sources * e = malloc(sizeof(reused_sources));
+    exit_fail_if(e == NULL, "Error: Out of memory\n");
+    e->chunk = c;
+    e->sources = *sources;
+    pthread_mutex_lock(&r->lock);
+    e->successor = r->sources;
+    r->sources = e;
+    pthread_mutex_unlock(&r->lock);
+}
+void reuse_clear(reuse * r)
+{
+    while (r->entries != NULL)
+    {
+        reused * e = r->entries;
+        r->entries = e->successor;
+        free(e);
+    }
+    while (r->sources != NULL)
+    {
+        reused_sources * e = r->sources;
+        r->sources = e->successor;
+        free(e);
+    }
+    r->hits = 0;
+    r->misses = 0;
+}
+
+enum ResolveState {unexpanded, expanding, expanded};
+
+unsigned long resolve_error(code_chunk * c, code_chunk * r, const char * problem)
+{
+    fprintf(stderr, "Error: Invocation of %s chunk '%.*s' in chunk '%.*s' "
+                    "defined on line %d\n"
+           , problem, (int)r->name_length, r->name
+           , (int)c->name_length, c->name, c->line
+           );
+    return 1;
+}
+
+unsigned long code_chunk_resolve(expansion * x, int * state, code_chunk * c)
+{
+    unsigned long errors = 0;
+
+    x->count = 0;
+    state[c->index] = expanding;
+    expansion_push(x, c, 0, 0);
+    while (x->count != 0)
+    {
+        frame * top = x->frames + x->count - 1;
+        chunk_contents * contents = top->contents;
+        code_chunk * r;
+        if (contents == NULL)
+        {
+            state[top->chunk->index] = expanded; /* (6) */
+            --x->count;
+            continue;
+        }
+        top->contents = contents->successor;
+        r = contents->reference;
+        if (contents_type(contents) != reference) continue;
+        else if (!r->defined) /* (1) */
+            errors += resolve_error(top->chunk, r, "undefined");
+        else if (r->tangle) /* (2) */
+            errors += resolve_error(top->chunk, r, "tangle");
+        else if (state[r->index] == expanding) /* (3) */
+            errors += resolve_error(top->chunk, r, "recursive");
+        else if (state[r->index] == expanded && r->reusable) /* (7) */
+            continue;
+        else if (state[r->index] == expanded) /* (4) */
+            errors += resolve_error(top->chunk, r, "already invoked");
+        else
+        {
+            state[r->index] = expanding; /* (5) */
+            expansion_push(x, r, 0, 0);
+        }
+    }
+    return errors;
+}
+
+tangle * document_resolve(document * doc, int update, int linemap, size_t * count)
+{
+    size_t i;
+    list * l;
+    tangle * files;
+    expansion x = {NULL, 0, 0};
+    int * state = calloc(doc->chunks->count + 1, sizeof(int));
+    unsigned long errors = 0;
+    exit_fail_if(state == NULL, "Error: Out of memory\n");
+
+    reuse_clear(&doc->reuse); /* (6) */
+    for (*count = 0, l = doc->tangles; l != NULL; l = l->successor) ++*count;
+    files = arena_alloc(&doc->memory, (*count + 1) * sizeof(tangle));
+    for (i = 0, l = doc->tangles; l != NULL; ++i, l = l->successor) /* (1) */
+    {
+        code_chunk * c = l->data;
+        files[i].chunk = c;
+        files[i].path = arena_strndup(&doc->memory, c->name, c->name_length); /* (2) */
+        files[i].error = NULL;
+        files[i].cache = NULL;
+        files[i].update = update;
+        files[i].status = written;
+        files[i].seconds = 0;
+        files[i].reuse = &doc->reuse;
+        files[i].linemap = linemap ? doc->file : NULL;
+        errors += code_chunk_resolve(&x, state, c); /* (3) */
+    }
+    free(state);
+    free(x.frames);
+    exit_fail_if(errors != 0 /* (4) */
+                , "Error: found %lu invalid invocation(s), no files were written\n"
+                , errors
+                );
+    return files;
+}
+
+size_t tangle_errors(tangle * files, size_t count)
+{
+    size_t i, failed = 0;
+    for (i = 0; i < count; ++i) /* (5) */
+    {
+        if (files[i].error == NULL) continue;
+        fprintf(stderr, files[i].error, files[i].path);
+        ++failed;
+    }
+    return failed;
+}
+
+void code_chunk_compile(plan * p, code_chunk * c)
+{
+    expansion * x = &p->stack;
+
+    x->count = 0;
+    expansion_push(x, c, 0, 0);
+    while (x->count != 0)
+    {
+        frame * top = x->frames + x->count - 1;
+        chunk_contents * contents = top->contents;
+        size_t indent = top->indent;
+        size_t indent_length = top->indent_length;
+        if (contents == NULL)
+        {
+            if (top->chunk->reusable) reuse_add(p, top); /* (3) */
+            --x->count;
+            continue;
+        }
+        if (contents_type(contents) == code) /* (1) */
+        {
+            size_t length = contents->partial_line ? contents->length : contents->length + 1; /* (3) */
+            if (contents->length != 0) plan_add(p, indent, indent_length, contents->string, length);
+            else plan_add(p, 0, 0, contents->string, length); /* (1) */
+            line_map_add(&p->lines, contents->line, 1); /* (4) */
+
+            if (contents->partial_line) /* (2) TODO should this be while? */
+            {
+                exit_fail_if(contents->successor == NULL
+                            , "Error: Partial line without successor in chunk '%.*s':\n"
+                              "       %.*s"
+                            , (int)top->chunk->name_length, top->chunk->name
+                            , (int)contents->length, contents->string
+                            );
+                contents = contents->successor;
+                plan_add(p, 0, 0, contents->string, contents->length + 1);
+            }
+            top->contents = contents->successor;
+        }
+        else if (contents_type(contents) == reference) /* (2) */
+        {
+            code_chunk * next_c = contents->reference;
+            size_t next_indent = indent;
+            size_t next_length = indent_length + contents->length;
+            size_t used = p->indents.length;
+            const reused * r = NULL;
+            top->contents = contents->successor;
+            if (contents->length != 0 && indent + indent_length != used) /* (1.b) */
+            {
+                next_indent = used;
+                prefix_reserve(&p->indents, next_length);
+                prefix_append(&p->indents, p->indents.string + indent, indent_length);
+            }
+            prefix_append(&p->indents, contents->string, contents->length); /* (1.a) */
+            if (next_c->reusable) r = reuse_find(p->reuse, next_c, p->indents.string + next_indent, next_length);
+            if (r != NULL) /* (2) */
+            {
+                size_t i;
+                p->indents.length = used;
+                plan_add(p, 0, 0, r->string, r->length);
+                for (i = 0; i < r->run_count; ++i) line_map_add(&p->lines, r->runs[i].source, r->runs[i].count);
+            }
+            else /* (3) */
+            {
+                expansion_push(x, next_c, next_indent, next_length);
+                x->frames[x->count - 1].first = p->count;
+                x->frames[x->count - 1].lines = p->lines.lines;
+            }
+        }
+    }
+}
+
+void plan_compile(plan * p, code_chunk * c, struct Reuse * r)
+{
+    p->count = 0; /* (1) */
+    p->indents.length = 0;
+    p->lines.count = 0;
+    p->lines.lines = 0;
+    p->reuse = r;
+    code_chunk_compile(p, c);
+}
+
+void plan_emit(plan * p, output * out)
+{
+    emit * e = p->emits;
+    emit * end = p->emits + p->count;
+    for (; e != end; ++e)
+    {
+        if (e->indent_length != 0)
+            output_write(out, p->indents.string + e->indent, e->indent_length);
+        output_write(out, e->string, e->length);
+    }
+}
+
+void code_chunk_digest(expansion * x, reuse * r, digest * h, code_chunk * c, int lines)
+{
+    digest sources;
+    x->count = 0;
+    expansion_push(x, c, 0, 0);
+    while (x->count != 0)
+    {
+        frame * top = x->frames + x->count - 1;
+        chunk_contents * contents = top->contents;
+        if (contents == NULL)
+        {
+            if (x->count > 1 && top->chunk->reusable)
+            {
+                reuse_add_sources(r, top->chunk, h); /* (5) */
+                sources = *h;
+                *h = top->outer;
+                digest_update(h, (const char *)&sources, sizeof(digest)); /* (6) */
+            }
+            if (--x->count != 0) digest_update(h, "}", 1); /* (2) */
+            continue;
+        }
+        top->contents = contents->successor;
+        digest_update(h, contents->string, contents->length);
+        if (lines) digest_update(h, (const char *)&contents->line, sizeof(contents->line)); /* (3) */
+        if (contents_type(contents) != reference)
+            digest_update(h, contents->partial_line ? "@" : "\n", 1);
+        else if (contents->reference->reusable && reuse_find_sources(r, contents->reference, &sources))
+        {
+            digest_update(h, "{", 1);
+            digest_update(h, (const char *)&sources, sizeof(digest)); /* (7) */
+            digest_update(h, "}", 1);
+        }
+        else
+        {
+            digest_update(h, "{", 1); /* (1) */
+            expansion_push(x, contents->reference, 0, 0);
+            if (contents->reference->reusable) /* (4) */
+            {
+                x->frames[x->count - 1].outer = *h;
+                digest_init(h);
+            }
+        }
+    }
+}
+
+int file_has_size(const char * path, size_t size)
+{
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size == size;
+}
+
+int file_has_contents(const char * path, const char * contents, size_t length)
+{
+    char block[65536];
+    struct stat st;
+    int same = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size == length)
+    {
+        ssize_t n;
+        same = 1;
+        while (same && (n = read(fd, block, sizeof(block))) != 0)
+        {
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 || (size_t)n > length || memcmp(block, contents, n) != 0)
+                same = 0;
+            else contents += n, length -= n;
+        }
+        if (length != 0) same = 0;
+    }
+    close(fd);
+    return same;
+}
+
+int open_temporary(const char * path, char ** temporary)
+{
+    struct stat st;
+    int fd;
+    char * name = malloc(strlen(path) + 64);
+    exit_fail_if(name == NULL, "Error: Out of memory\n");
+    sprintf(name, "%s.lili-%ld-%lx", path, (long)getpid(), (unsigned long)path);
+    unlink(name); /* (1) */
+    fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd < 0)
+    {
+        free(name);
+        return fd;
+    }
+    if (stat(path, &st) == 0) fchmod(fd, st.st_mode & 07777); /* (2) */
+    *temporary = name;
+    return fd;
+}
+
+tangle ** cache_entries_new(document * doc, tangle * files, size_t count)
+{
+    size_t i;
+    tangle ** tangles = calloc(doc->chunks->count + 1, sizeof(tangle *));
+    exit_fail_if(tangles == NULL, "Error: Out of memory\n");
+    for (i = 0; i < count; ++i) /* (1) */
+    {
+        files[i].cache = arena_alloc(&doc->memory, sizeof(cache_entry));
+        files[i].cache->valid = 0;
+        tangles[files[i].chunk->index] = &files[i];
+    }
+    return tangles;
+}
+
+void cache_entry_match( dict * d, tangle ** tangles
+                      , const char * path, size_t length, const cache_entry * e
+                      )
+{
+    code_chunk * c = dict_get(d, path, length); /* (2) */
+    if (c == NULL || !c->tangle || tangles[c->index] == NULL) return;
+    *tangles[c->index]->cache = *e;
+}
+
+void cache_read(const char * path, document * doc, tangle * files, size_t count)
+{
+    char line[4096];
+    tangle ** tangles = cache_entries_new(doc, files, count);
+    FILE * f = fopen(path, "r");
+
+    while (f != NULL && fgets(line, sizeof(line), f) != NULL)
+    {
+        cache_entry e;
+        unsigned long sources_length, contents_length;
+        size_t name_length;
+        int n = 0;
+
+        sscanf(line, "%8lx%8lx %lu %8lx%8lx %lu %n"
+              , &e.sources.fnv, &e.sources.djb, &sources_length
+              , &e.contents.fnv, &e.contents.djb, &contents_length, &n
+              );
+        name_length = strcspn(line + n, "\n");
+        if (n == 0 || name_length == 0) continue;
+
+        e.valid = 1;
+        e.sources.length = sources_length;
+        e.contents.length = contents_length;
+        cache_entry_match(doc->chunks, tangles, line + n, name_length, &e);
+    }
+
+    if (f != NULL) fclose(f);
+    free(tangles);
+}
+void cache_write(const char * path, tangle * files, size_t count)
+{
+    size_t i;
+    char * temporary = malloc(strlen(path) + 5);
+    FILE * f;
+
+    exit_fail_if(temporary == NULL, "Error: Out of memory\n");
+    sprintf(temporary, "%s.tmp", path);
+    f = fopen(temporary, "w");
+    exit_fail_if(f == NULL, "Error: Failed to open cache file '%s'\n", temporary);
+    for (i = 0; i < count; ++i)
+    {
+        cache_entry * e = files[i].cache;
+        if (!e->valid) continue;
+        fprintf(f, "%08lx%08lx %lu %08lx%08lx %lu %s\n"
+               , e->sources.fnv, e->sources.djb, (unsigned long)e->sources.length
+               , e->contents.fnv, e->contents.djb, (unsigned long)e->contents.length
+               , files[i].path
+               );
+    }
+    exit_fail_if(fclose(f) != 0 || rename(temporary, path) != 0
+                , "Error: Failed to write cache file '%s'\n", path
+                );
+    free(temporary);
+}
+
+void line_map_write(line_map * m, tangle * t)
+{
+    size_t i;
+    char * path = malloc(strlen(t->path) + 9);
+    FILE * f;
+    exit_fail_if(path == NULL, "Error: Out of memory\n");
+    sprintf(path, "%s.linemap", t->path);
+    f = fopen(path, "w");
+    if (f != NULL)
+    {
+        fprintf(f, "%s\n", t->linemap);
+        for (i = 0; i < m->count; ++i)
+            fprintf(f, "%lu %lu %lu\n", m->runs[i].line + 1, m->runs[i].source, m->runs[i].count);
+    }
+    if (f == NULL || fclose(f) != 0) t->error = "Error: Failed to write the line map of '%s'\n";
+    free(path);
+}
+char * line_map_read(const char * file, line_map * m)
+{
+    char * path = malloc(strlen(file) + 9);
+    char * source = NULL;
+    size_t size = 0;
+    ssize_t length;
+    line_run r;
+    FILE * f;
+    exit_fail_if(path == NULL, "Error: Out of memory\n");
+    sprintf(path, "%s.linemap", file);
+    f = fopen(path, "r");
+    free(path);
+    m->count = 0;
+    if (f == NULL) return NULL;
+    if ((length = getline(&source, &size, f)) > 0 && source[length - 1] == '\n') /* (1) */
+        source[length - 1] = '\0';
+    while (fscanf(f, "%lu %lu %lu", &r.line, &r.source, &r.count) == 3)
+    {
+        if (m->count == m->capacity)
+        {
+            m->capacity = m->capacity ? m->capacity * 2 : 256;
+            m->runs = realloc(m->runs, m->capacity * sizeof(line_run));
+            exit_fail_if(m->runs == NULL, "Error: Out of memory\n");
+        }
+        m->runs[m->count++] = r;
+    }
+    fclose(f);
+    return source;
+}
+
+const line_run * line_map_find(const line_map * m, unsigned long line)
+{
+    size_t low = 0, high = m->count;
+    while (low < high) /* (2) */
+    {
+        size_t middle = low + (high - low) / 2;
+        if (m->runs[middle].line <= line) low = middle + 1;
+        else high = middle;
+    }
+    if (low == 0 || line >= m->runs[low - 1].line + m->runs[low - 1].count) return NULL; /* (3) */
+    return m->runs + low - 1;
+}
+
+int line_map_locate(char ** locations, int count)
+{
+    line_map m = {NULL, 0, 0, 0};
+    const char * file = NULL;
+    char * source = NULL;
+    int i, failed = 0;
+    for (i = 0; i < count; ++i)
+    {
+        char * colon = strrchr(locations[i], ':');
+        const line_run * r = NULL;
+        unsigned long line;
+        if (colon == NULL)
+        {
+            fprintf(stderr, "Error: Expected FILE:LINE rather than '%s'\n", locations[i]);
+            failed = 1;
+            continue;
+        }
+        *colon = '\0';
+        line = strtoul(colon + 1, NULL, 10);
+        if (file == NULL || strcmp(file, locations[i]) != 0) /* (4) */
+        {
+            free(source);
+            source = line_map_read(file = locations[i], &m);
+        }
+        if (source != NULL) r = line_map_find(&m, line);
+        if (r == NULL)
+        {
+            fprintf(stderr, "Error: No line map for line %lu of '%s'\n", line, locations[i]);
+            failed = 1;
+        }
+        else printf("%s:%lu\n", source, r->source + (line - r->line));
+    }
+    free(source);
+    free(m.runs);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+void tangle_file(output * out, plan * p, tangle * t)
+{
+    int fd;
+    char * temporary = NULL;
+
+    if (t->cache != NULL || t->update) /* (5) */
+    {
+        if (t->cache != NULL)
+        {
+            digest sources;
+            digest_init(&sources);
+            code_chunk_digest(&p->stack, t->reuse, &sources, t->chunk, t->linemap != NULL);
+            if (  t->cache->valid && digest_equal(&sources, &t->cache->sources)
+               && file_has_size(t->path, t->cache->contents.length)
+               )
+            {
+                t->status = skipped; /* (1) */
+                return;
+            }
+            t->cache->sources = sources;
+        }
+        out->fd = -1;
+        plan_compile(p, t->chunk, t->reuse); /* (2) */
+        plan_emit(p, out);
+        if (t->linemap != NULL) line_map_write(&p->lines, t);
+        if (t->cache != NULL)
+        {
+            {
+                digest contents;
+                digest_init(&contents);
+                digest_update(&contents, out->buffer, out->used);
+                if (  t->cache->valid && digest_equal(&contents, &t->cache->contents)
+                   && file_has_size(t->path, contents.length)
+                   )
+                {
+                    out->used = 0;
+                    t->status = unchanged; /* (1) */
+                    return;
+                }
+                t->cache->valid = 0;
+                t->cache->contents = contents;
+            }
+        }
+        if (t->update)
+        {
+            if (file_has_contents(t->path, out->buffer, out->used))
+            {
+                out->used = 0;
+                t->status = unchanged; /* (1) */
+                if (t->cache != NULL) t->cache->valid = 1;
+                return;
+            }
+        }
+    }
+
+    if (t->update) fd = open_temporary(t->path, &temporary);
+    else fd = open(t->path, O_WRONLY | O_CREAT | O_TRUNC, 0666); /* (1) */
+    if (fd < 0)
+    {
+        t->error = "Error: Failed to open file '%s', skipping tangle\n"; /* (4) */
+        out->used = 0; /* (6) */
+        return;
+    }
+    out->fd = fd;
+    out->failed = 0;
+    if (t->cache == NULL && !t->update)
+    {
+        plan_compile(p, t->chunk, t->reuse); /* (2) */
+        plan_emit(p, out);
+        if (t->linemap != NULL) line_map_write(&p->lines, t);
+    }
+    output_flush(out); /* (3) */
+    if (close(fd) != 0) out->failed = 1;
+    if (temporary != NULL)
+    {
+        if (!out->failed && rename(temporary, t->path) != 0) out->failed = 1;
+        if (out->failed) unlink(temporary);
+        free(temporary);
+    }
+    if (out->failed) t->error = "Error: Failed to write to file '%s'\n"; /* (4) */
+    else if (t->cache != NULL) t->cache->valid = 1;
+}
+
+typedef struct Tangler
+{
+    tangle * files;
+    size_t count;
+    size_t next;
+    pthread_mutex_t lock;
+} tangler;
+
+typedef struct Worker
+{
+    tangler * job;
+    output out;
+    plan plan;
+    pthread_t thread;
+} worker;
+
+void * tangle_worker(void * arg)
+{
+    worker * w = arg;
+    for (;;)
+    {
+        size_t i;
+        pthread_mutex_lock(&w->job->lock); /* (1) */
+        i = w->job->next++;
+        pthread_mutex_unlock(&w->job->lock);
+        if (i >= w->job->count) break;
+        {
+            double start = seconds();
+            tangle_file(&w->out, &w->plan, &w->job->files[i]); /* (2) */
+            w->job->files[i].seconds = seconds() - start;
+        }
+    }
+    return NULL;
+}
+
+void tangle_files(tangle * files, size_t count, int jobs, output * out)
+{
+    tangler job;
+    worker * workers;
+    int i, started = 0;
+
+    if (jobs > (int)count) jobs = count;
+    if (jobs < 1) jobs = 1;
+    workers = calloc(jobs, sizeof(worker));
+    exit_fail_if(workers == NULL, "Error: Out of memory\n");
+
+    job.files = files;
+    job.count = count;
+    job.next = 0;
+    pthread_mutex_init(&job.lock, NULL);
+
+    for (i = 1; i < jobs; ++i)
+    {
+        workers[i].job = &job;
+        output_init(&workers[i].out, out->capacity);
+        if (pthread_create(&workers[i].thread, NULL, tangle_worker, &workers[i]) != 0)
+        {
+            output_free(&workers[i].out);
+            break;
+        }
+        ++started;
+    }
+
+    workers[0].job = &job; /* (3) */
+    workers[0].out = *out;
+    tangle_worker(&workers[0]);
+    *out = workers[0].out;
+    plan_free(&workers[0].plan);
+
+    for (i = 1; i <= started; ++i) /* (4) */
+    {
+        pthread_join(workers[i].thread, NULL);
+        out->bytes += workers[i].out.bytes; /* (5) */
+        out->writes += workers[i].out.writes;
+        output_free(&workers[i].out);
+        plan_free(&workers[i].plan);
+    }
+
+    pthread_mutex_destroy(&job.lock);
+    free(workers);
+}
+
+typedef struct Watcher
+{
+    const char * path;
+    const char * name;
+    int fd;
+    struct stat st;
+} watcher;
+
+int watcher_stat(watcher * w, struct stat * st)
+{
+    if (stat(w->path, st) != 0) return 0;
+    return st->st_mtime != w->st.st_mtime || st->st_size != w->st.st_size
+        || st->st_ino != w->st.st_ino;
+}
+
+void watcher_init(watcher * w, const char * path)
+{
+    const char * slash = strrchr(path, '/');
+    w->path = path;
+    w->name = slash != NULL ? slash + 1 : path;
+    w->fd = -1;
+    memset(&w->st, 0, sizeof(w->st));
+    watcher_stat(w, &w->st);
+#ifdef __linux__
+    {
+        char * directory = slash == NULL ? strdup(".")
+                         : slash == path ? strdup("/")
+                         : strndup(path, slash - path);
+        exit_fail_if(directory == NULL, "Error: Out of memory\n");
+        w->fd = inotify_init1(IN_CLOEXEC);
+        if (  w->fd >= 0
+           && inotify_add_watch(w->fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) < 0 /* (1, 2) */
+           )
+        {
+            close(w->fd);
+            w->fd = -1;
+        }
+        free(directory);
+    }
+#endif
+}
+
+int watcher_read(watcher * w)
+{
+#ifdef __linux__
+    union { struct inotify_event event; char bytes[4096]; } events;
+    char * e = events.bytes;
+    ssize_t n = read(w->fd, events.bytes, sizeof(events));
+    if (n < 0 && errno == EINTR) return 0;
+    if (n > 0)
+    {
+        while (e < events.bytes + n)
+        {
+            struct inotify_event * event = (struct inotify_event *)e;
+            if (event->len != 0 && strcmp(event->name, w->name) == 0) return 1;
+            e += sizeof(struct inotify_event) + event->len;
+        }
+        return 0;
+    }
+#endif
+    close(w->fd); /* (4) */
+    w->fd = -1;
+    return 0;
+}
+
+void watcher_wait(watcher * w)
+{
+    while (w->fd >= 0) if (watcher_read(w)) return;
+    for (;;) /* (3) */
+    {
+        struct timespec tenth = {0, 100000000L};
+        struct stat st;
+        nanosleep(&tenth, NULL);
+        if (watcher_stat(w, &st))
+        {
+            w->st = st;
+            return;
+        }
+    }
+}
+
+typedef struct CacheMemo
+{
+    char ** paths;
+    cache_entry * entries;
+    size_t count;
+} cache_memo;
+
+void cache_recall(cache_memo * m, document * doc, tangle * files, size_t count)
+{
+    size_t i;
+    tangle ** tangles = cache_entries_new(doc, files, count);
+    for (i = 0; i < m->count; ++i)
+        cache_entry_match(doc->chunks, tangles, m->paths[i], strlen(m->paths[i]), &m->entries[i]);
+    free(tangles);
+}
+
+void cache_remember(cache_memo * m, tangle * files, size_t count)
+{
+    size_t i;
+    for (i = 0; i < m->count; ++i) free(m->paths[i]);
+    free(m->paths);
+    free(m->entries);
+    m->paths = malloc((count + 1) * sizeof(char *));
+    m->entries = malloc((count + 1) * sizeof(cache_entry));
+    exit_fail_if(m->paths == NULL || m->entries == NULL, "Error: Out of memory\n");
+    m->count = 0;
+    for (i = 0; i < count; ++i)
+    {
+        if (!files[i].cache->valid) continue;
+        m->paths[m->count] = strdup(files[i].path);
+        exit_fail_if(m->paths[m->count] == NULL, "Error: Out of memory\n");
+        m->entries[m->count++] = *files[i].cache;
+    }
+}
+
+typedef struct RunCounts
+{
+    unsigned long contents;
+    unsigned long references;
+    unsigned long status[3];
+} run_counts;
+
+void run_counts_collect(run_counts * counts, dict * d, tangle * files, size_t count)
+{
+    size_t i;
+    memset(counts, 0, sizeof(run_counts));
+    for (i = 0; i < d->size; ++i) /* (1) */
+    {
+        chunk_contents * c;
+        if (d->array[i] == NULL) continue;
+        for (c = d->array[i]->contents; c != NULL; c = c->successor)
+        {
+            counts->contents += 1;
+            if (contents_type(c) == reference) counts->references += 1;
+        }
+    }
+    for (i = 0; i < count; ++i) counts->status[files[i].status] += 1; /* (2) */
+}
+const char * status_names[3] = {"written", "unchanged", "skipped"};
+
+double reuse_rate(reuse * r)
+{
+    unsigned long total = r->hits + r->misses;
+    return total == 0 ? 0 : (double)r->hits / total;
+}
+
+void stats_print_text( FILE * f, run_times * t, run_counts * counts, document * doc
+                     , output * out, tangle * files, size_t count
+                     )
+{
+    size_t i;
+    dict * d = doc->chunks;
+    fprintf(f, "memory: %lu bytes in %lu allocations from %lu blocks\n"
+           , doc->memory.bytes, doc->memory.allocations, doc->memory.blocks
+           );
+    dict_print_stats(f, d);
+    fprintf(f, "chunks: %lu chunks, %lu contents entries, %lu references\n"
+           , (unsigned long)d->count, counts->contents, counts->references
+           );
+    if (doc->regions.keep)
+        fprintf(f, "parse: %lu bytes rescanned of %lu\n"
+               , doc->regions.rescanned, (unsigned long)doc->regions.length
+               );
+    if (doc->snapshot) fprintf(f, "parse: loaded from snapshot\n");
+    fprintf(f, "output: %lu bytes in %lu writes\n", out->bytes, out->writes);
+    fprintf(f, "reuse: %lu hits, %lu misses, %.1f%% hit rate\n"
+           , doc->reuse.hits, doc->reuse.misses
+           , reuse_rate(&doc->reuse) * 100
+           );
+    fprintf(f, "time: %.2f ms reading, %.2f ms parsing, %.2f ms resolving, "
+               "%.2f ms tangling\n"
+           , (t->loaded - t->started) * 1e3, (t->parsed - t->loaded) * 1e3
+           , (t->resolved - t->parsed) * 1e3, (t->tangled - t->resolved) * 1e3
+           );
+    fprintf(f, "tangles: %lu written, %lu unchanged, %lu skipped\n"
+           , counts->status[written], counts->status[unchanged]
+           , counts->status[skipped]
+           );
+    for (i = 0; i < count; ++i)
+        fprintf(f, "tangle: %.2f ms %s %s\n"
+               , files[i].seconds * 1e3, status_names[files[i].status], files[i].path
+               );
+}
+void json_string_n(FILE * f, const char * s, size_t length)
+{
+    fputc('"', f);
+    for (; length != 0; ++s, --length) /* (1) */
+    {
+        if (*s == '"' || *s == '\\') fprintf(f, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20) fprintf(f, "\\u%04x", *s);
+        else fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+void json_string(FILE * f, const char * s)
+{
+    json_string_n(f, s, strlen(s));
+}
+
+void stats_print_json( FILE * f, run_times * t, run_counts * counts, document * doc
+                     , output * out, tangle * files, size_t count
+                     )
+{
+    size_t i;
+    dict * d = doc->chunks;
+    fprintf(f, "{\"time_ms\": {\"read\": %.3f, \"parse\": %.3f, "
+               "\"resolve\": %.3f, \"tangle\": %.3f}"
+           , (t->loaded - t->started) * 1e3, (t->parsed - t->loaded) * 1e3
+           , (t->resolved - t->parsed) * 1e3, (t->tangled - t->resolved) * 1e3
+           );
+    fprintf(f, ", \"memory\": {\"bytes\": %lu, \"allocations\": %lu, "
+               "\"blocks\": %lu}"
+           , doc->memory.bytes, doc->memory.allocations, doc->memory.blocks
+           );
+    fprintf(f, ", \"dict\": {\"chunks\": %lu, \"slots\": %lu, "
+               "\"lookups\": %lu, \"probes\": %lu, \"max_probes\": %lu}"
+           , (unsigned long)d->count, (unsigned long)d->size
+           , d->lookups, d->probes, d->max_probes
+           );
+    fprintf(f, ", \"contents\": %lu, \"references\": %lu"
+           , counts->contents, counts->references
+           );
+    if (doc->regions.keep)
+        fprintf(f, ", \"rescanned\": %lu, \"source_bytes\": %lu"
+               , doc->regions.rescanned, (unsigned long)doc->regions.length
+               );
+    fprintf(f, ", \"snapshot\": %s", doc->snapshot ? "true" : "false");
+    fprintf(f, ", \"output\": {\"bytes\": %lu, \"writes\": %lu}"
+           , out->bytes, out->writes
+           );
+    fprintf(f, ", \"reuse\": {\"hits\": %lu, \"misses\": %lu, \"hit_rate\": %.3f}"
+           , doc->reuse.hits, doc->reuse.misses, reuse_rate(&doc->reuse)
+           );
+    fprintf(f, ", \"tangles\": [");
+    for (i = 0; i < count; ++i)
+    {
+        fprintf(f, "%s{\"path\": ", i == 0 ? "" : ", ");
+        json_string(f, files[i].path);
+        fprintf(f, ", \"status\": \"%s\", \"time_ms\": %.3f}"
+               , status_names[files[i].status], files[i].seconds * 1e3
+               );
+    }
+    fprintf(f, "]}\n");
+}
+
+int code_chunk_order(const void * a, const void * b)
+{
+    const code_chunk * x = *(const code_chunk * const *)a;
+    const code_chunk * y = *(const code_chunk * const *)b;
+    int order;
+    if (x->line != y->line) return x->line < y->line ? -1 : 1;
+    order = memcmp(x->name, y->name, x->name_length < y->name_length ? x->name_length : y->name_length);
+    if (order != 0) return order;
+    return x->name_length < y->name_length ? -1 : x->name_length > y->name_length;
+}
+
+code_chunk ** chunks_in_order(dict * d)
+{
+    size_t i, n = 0;
+    code_chunk ** chunks = calloc(d->count + 1, sizeof(code_chunk *));
+    exit_fail_if(chunks == NULL, "Error: Out of memory\n");
+    for (i = 0; i < d->size; ++i)
+        if (d->array[i] != NULL) chunks[n++] = d->array[i];
+    qsort(chunks, n, sizeof(code_chunk *), code_chunk_order); /* (1) */
+    return chunks;
+}
+
+void graph_write_chunks(FILE * f, expansion * x, size_t * listed, size_t mark, code_chunk * c)
+{
+    x->count = 0;
+    json_string_n(f, c->name, c->name_length);
+    expansion_push(x, c, 0, 0);
+    while (x->count != 0) /* (2) */
+    {
+        frame * top = x->frames + x->count - 1;
+        chunk_contents * contents = top->contents;
+        if (contents == NULL)
+        {
+            --x->count;
+            continue;
+        }
+        top->contents = contents->successor;
+        if (contents_type(contents) != reference) continue;
+        if (listed[contents->reference->index] == mark) continue; /* (3) */
+        listed[contents->reference->index] = mark;
+        fputs(", ", f);
+        json_string_n(f, contents->reference->name, contents->reference->name_length);
+        expansion_push(x, contents->reference, 0, 0);
+    }
+}
+
+void graph_write(const char * path, document * doc, tangle * files, size_t count)
+{
+    size_t i;
+    int first;
+    dict * d = doc->chunks;
+    expansion x = {NULL, 0, 0};
+    code_chunk ** chunks = chunks_in_order(d);
+    size_t * listed = calloc(d->count + 1, sizeof(size_t));
+    FILE * f = fopen(path, "w");
+    exit_fail_if(listed == NULL, "Error: Out of memory\n");
+    exit_fail_if(f == NULL, "Error: Failed to open graph file '%s'\n", path);
+
+    fputs("{\"source\": ", f);
+    json_string(f, doc->file);
+    fputs(", \"chunks\": [", f);
+    for (i = 0; i < d->count; ++i)
+    {
+        code_chunk * c = chunks[i];
+        chunk_contents * contents;
+        first = 1;
+        fputs(i == 0 ? "\n  {\"name\": " : ",\n  {\"name\": ", f);
+        json_string_n(f, c->name, c->name_length);
+        fprintf(f, ", \"defined\": %s, \"tangle\": %s, \"reusable\": %s, "
+                   "\"line\": %d, \"invokes\": ["
+               , c->defined ? "true" : "false", c->tangle ? "true" : "false"
+               , c->reusable ? "true" : "false", c->line
+               );
+        for (contents = c->contents; contents != NULL; contents = contents->successor)
+        {
+            if (contents_type(contents) != reference) continue;
+            if (!first) fputs(", ", f);
+            first = 0;
+            json_string_n(f, contents->reference->name, contents->reference->name_length);
+        }
+        fputs("]}", f);
+    }
+    fputs("],\n\"definitions\": [", f);
+    for (i = 0, first = 1; i < doc->regions.count; ++i)
+    {
+        region * r = doc->regions.regions + i;
+        if (r->chunk == NULL) continue;
+        fputs(first ? "\n  {\"chunk\": " : ",\n  {\"chunk\": ", f);
+        first = 0;
+        json_string_n(f, r->chunk->name, r->chunk->name_length);
+        fprintf(f, ", \"lines\": [%d, %d]}", r->line - 1, r->end_line - 1);
+    }
+    fputs("],\n\"tangles\": [", f);
+    for (i = 0; i < count; ++i)
+    {
+        fputs(i == 0 ? "\n  {\"path\": " : ",\n  {\"path\": ", f);
+        json_string(f, files[i].path);
+        fputs(", \"chunks\": [", f);
+        graph_write_chunks(f, &x, listed, i + 1, files[i].chunk);
+        fputs("]}", f);
+    }
+    fputs("]}\n", f);
+    exit_fail_if(fclose(f) != 0, "Error: Failed to write graph file '%s'\n", path);
+    free(chunks);
+    free(listed);
+    free(x.frames);
+}
+void depfile_path(FILE * f, const char * path)
+{
+    for (; *path != '\0'; ++path) /* (1) */
+    {
+        if (*path == ' ' || *path == '\\' || *path == '#') fputc('\\', f);
+        else if (*path == '$') fputc('$', f);
+        fputc(*path, f);
+    }
+}
+
+void depfile_write(const char * path, const char * source, tangle * files, size_t count)
+{
+    size_t i;
+    FILE * f = fopen(path, "w");
+    exit_fail_if(f == NULL, "Error: Failed to open dependency file '%s'\n", path);
+    for (i = 0; i < count; ++i)
+    {
+        depfile_path(f, files[i].path);
+        fputs(i + 1 < count ? " \\\n" : "", f);
+    }
+    fputs(": ", f);
+    depfile_path(f, source);
+    fputs("\n", f);
+    exit_fail_if(fclose(f) != 0, "Error: Failed to write dependency file '%s'\n", path);
+}
+
+#define WEAVE_PIECES 1024
+#define WEAVE_SHORT 256
+
+typedef struct Weaver
+{
+    int fd;
+    int failed;
+    struct iovec pieces[WEAVE_PIECES];
+    int count;
+    char buffer[1 << 16];
+    size_t used;
+} weaver;
+
+void weave_flush(weaver * w)
+{
+    struct iovec * piece = w->pieces;
+    int count = w->count;
+    while (count > 0 && !w->failed)
+    {
+        ssize_t n = writev(w->fd, piece, count);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) w->failed = 1;
+        for (; count > 0 && n >= (ssize_t)piece->iov_len; ++piece, --count)
+            n -= piece->iov_len;
+        if (count > 0 && n > 0)
+        {
+            piece->iov_base = (char *)piece->iov_base + n;
+            piece->iov_len -= n;
+        }
+    }
+    w->count = 0;
+    w->used = 0;
+}
+
+void weave_piece(weaver * w, const char * s, size_t length)
+{
+    struct iovec * last;
+    if (length == 0) return;
+    if (w->count == WEAVE_PIECES || (length < WEAVE_SHORT && w->used + length > sizeof(w->buffer)))
+        weave_flush(w);
+    if (length < WEAVE_SHORT) /* (1) */
+    {
+        s = memcpy(w->buffer + w->used, s, length);
+        w->used += length;
+    }
+    last = w->count != 0 ? w->pieces + w->count - 1 : NULL;
+    if (last != NULL && (const char *)last->iov_base + last->iov_len == s) /* (2) */
+        last->iov_len += length;
+    else
+    {
+        w->pieces[w->count].iov_base = (void *)s;
+        w->pieces[w->count++].iov_len = length;
+    }
+}
+
+void weave_string(weaver * w, const char * s)
+{
+    weave_piece(w, s, strlen(s));
+}
+
+void weave_number(weaver * w, int n)
+{
+    char digits[16];
+    weave_piece(w, digits, sprintf(digits, "%d", n)); /* (3) */
+}
+typedef struct Users
+{
+    size_t * first;
+    size_t * last;
+    code_chunk ** chunks;
+} users;
+
+void users_collect(users * u, code_chunk ** chunks, size_t count)
+{
+    size_t i, total = 0;
+    chunk_contents * c;
+    u->first = calloc(count + 1, sizeof(size_t));
+    u->last = calloc(count + 1, sizeof(size_t));
+    exit_fail_if(u->first == NULL || u->last == NULL, "Error: Out of memory\n");
+    for (i = 0; i < count; ++i) /* (1) */
+        for (c = chunks[i]->contents; c != NULL; c = c->successor)
+            if (contents_type(c) == reference) ++u->first[c->reference->index];
+    for (i = 0; i <= count; ++i) /* (2) */
+    {
+        size_t n = u->first[i];
+        u->first[i] = u->last[i] = total;
+        total += n;
+    }
+    u->chunks = malloc((total + 1) * sizeof(code_chunk *));
+    exit_fail_if(u->chunks == NULL, "Error: Out of memory\n");
+    for (i = 0; i < count; ++i) /* (3) */
+        for (c = chunks[i]->contents; c != NULL; c = c->successor)
+        {
+            size_t r;
+            if (contents_type(c) != reference) continue;
+            r = c->reference->index;
+            if (u->last[r] == u->first[r] || u->chunks[u->last[r] - 1] != chunks[i]) /* (4) */
+                u->chunks[u->last[r]++] = chunks[i];
+        }
+}
+
+void users_free(users * u)
+{
+    free(u->first);
+    free(u->last);
+    free(u->chunks);
+}
+void weave_name(weaver * w, const char * name, size_t length)
+{
+    weave_string(w, "<<");
+    weave_piece(w, name, length);
+    weave_string(w, ">>");
+}
+
+void weave_definition(weaver * w, const char * source, size_t start, region * r, users * u)
+{
+    const char * line = source + start;
+    const char * body = source + r->body;
+    const char * at = memchr(line, r->atsign, body - line);
+    const char * name_end = memchr(at + 3, at[2], body - at - 3);
+    size_t i, index = r->chunk->index;
+
+    weave_piece(w, line, at - line); /* (1) */
+    weave_name(w, at + 3, name_end - at - 3);
+    weave_string(w, at[1] == '+' ? "+=" : "=");
+    for (i = u->first[index]; i < u->last[index]; ++i)
+    {
+        weave_string(w, i == u->first[index] ? " (used in " : ", ");
+        weave_name(w, u->chunks[i]->name, u->chunks[i]->name_length);
+    }
+    if (u->first[index] != u->last[index]) weave_string(w, ")");
+    weave_piece(w, name_end + 1, body - name_end - 1); /* (2) */
+}
+void weave_body(weaver * w, dict * d, const char * source, region * r)
+{
+    const char * s = source + r->body;
+    const char * end = source + r->end;
+    for (;;)
+    {
+        const char * at = memchr(s, r->atsign, end - s);
+        if (at == NULL) break;
+        weave_piece(w, s, at - s);
+        if (at[1] == '{') /* (1) */
+        {
+            const char * name_end = memchr(at + 2, '}', end - at - 2);
+            code_chunk * c = dict_get(d, at + 2, name_end - at - 2);
+            weave_name(w, at + 2, name_end - at - 2);
+            if (c != NULL && c->defined)
+            {
+                weave_string(w, " (line ");
+                weave_number(w, c->line);
+                weave_string(w, ")");
+            }
+            s = name_end + 1;
+        }
+        else if (at[1] == '/') /* (3) */
+        {
+            s = at + 2;
+            break;
+        }
+        else /* (2) */
+        {
+            const char * line_end = memchr(at + 1, '\n', end - at - 1);
+            weave_piece(w, at + 1, line_end + 1 - (at + 1));
+            s = line_end + 1;
+        }
+    }
+    weave_piece(w, s, end - s);
+}
+void weave_write(const char * path, document * doc)
+{
+    dict * d = doc->chunks;
+    const char * source = doc->regions.keep ? doc->regions.source : doc->mapped_source;
+    size_t length = doc->regions.keep ? doc->regions.length : doc->mapped_size;
+    size_t i, position = 0;
+    code_chunk ** chunks = chunks_in_order(d);
+    struct stat st;
+    users u;
+    weaver w;
+
+    if (source == NULL && stat(doc->file, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == 0)
+        source = "", length = 0; /* (4) */
+    exit_fail_if(source == NULL
+                , "Error: Can't weave %s, which couldn't be mapped into memory\n"
+                , doc->file
+                );
+    users_collect(&u, chunks, d->count);
+
+    w.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    exit_fail_if(w.fd < 0, "Error: Failed to open weave file '%s'\n", path);
+    w.failed = 0;
+    w.count = 0;
+    w.used = 0;
+    for (i = 0; i < doc->regions.count; ++i)
+    {
+        region * r = doc->regions.regions + i;
+        if (r->chunk == NULL) /* (3) */
+        {
+            weave_piece(&w, source + position, r->end - 3 - position);
+            position = r->end;
+            continue;
+        }
+        if (r->start > position) /* (5) */
+        {
+            weave_piece(&w, source + position, r->start - position); /* (1) */
+            position = r->start;
+        }
+        weave_definition(&w, source, position, r, &u); /* (2) */
+        weave_body(&w, d, source, r);
+        position = r->end;
+    }
+    weave_piece(&w, source + position, length - position);
+    weave_flush(&w);
+    exit_fail_if(close(w.fd) != 0 || w.failed
+                , "Error: Failed to write weave file '%s'\n", path
+                );
+    users_free(&u);
+    free(chunks);
+}
+
+#define SERVER_QUERY (1 << 16)
+
+typedef struct Client
+{
+    int fd;
+    char * buffer;
+    size_t used;
+    size_t capacity;
+} client;
+
+typedef struct Server
+{
+    int fd;
+    const char * path;
+    client * clients;
+    size_t count;
+    size_t capacity;
+    struct pollfd * polls;
+    document * doc;
+    int ready;
+    int indexed;
+    code_chunk ** chunks;
+    users users;
+    size_t * defined_first;
+    size_t * defined_last;
+    region ** definitions;
+    int * state;
+    expansion stack;
+    plan plan;
+    output out;
+    output text;
+} server;
+void server_init(server * s, const char * path)
+{
+    struct sockaddr_un address;
+    struct stat st;
+    memset(s, 0, sizeof(server));
+    memset(&address, 0, sizeof(address));
+    exit_fail_if(strlen(path) >= sizeof(address.sun_path)
+                , "Error: Socket path '%s' is too long\n", path
+                );
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path); /* (1) */
+    s->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    exit_fail_if(  s->fd < 0
+                || bind(s->fd, (struct sockaddr *)&address, sizeof(address)) != 0
+                || listen(s->fd, 64) != 0
+                , "Error: Failed to listen on socket '%s'\n", path
+                );
+    fcntl(s->fd, F_SETFL, O_NONBLOCK); /* (2) */
+    signal(SIGPIPE, SIG_IGN); /* (3) */
+    s->path = path;
+    output_init(&s->out, 1 << 16);
+    output_init(&s->text, 1 << 12);
+}
+void server_index(server * s)
+{
+    dict * d = s->doc->chunks;
+    region_map * m = &s->doc->regions;
+    size_t i, total = 0;
+    if (s->indexed) return;
+    s->chunks = chunks_in_order(d);
+    s->defined_first = calloc(d->count + 1, sizeof(size_t));
+    s->defined_last = calloc(d->count + 1, sizeof(size_t));
+    s->definitions = malloc((m->count + 1) * sizeof(region *));
+    exit_fail_if(  s->defined_first == NULL
+                || s->defined_last == NULL || s->definitions == NULL
+                , "Error: Out of memory\n"
+                );
+    users_collect(&s->users, s->chunks, d->count);
+    for (i = 0; i < m->count; ++i)
+        if (m->regions[i].chunk != NULL) ++s->defined_first[m->regions[i].chunk->index];
+    for (i = 0; i <= d->count; ++i)
+    {
+        size_t n = s->defined_first[i];
+        s->defined_first[i] = s->defined_last[i] = total;
+        total += n;
+    }
+    for (i = 0; i < m->count; ++i)
+        if (m->regions[i].chunk != NULL)
+            s->definitions[s->defined_last[m->regions[i].chunk->index]++] = m->regions + i;
+    s->indexed = 1;
+}
+
+void server_forget(server * s)
+{
+    if (!s->indexed) return;
+    users_free(&s->users);
+    free(s->chunks);
+    free(s->defined_first);
+    free(s->defined_last);
+    free(s->definitions);
+    s->indexed = 0;
+}
+void server_begin(server * s, int fd, const char * status, size_t length)
+{
+    char header[32];
+    s->out.fd = fd;
+    s->out.failed = 0;
+    output_write(&s->out, header, sprintf(header, "%s %lu\n", status, (unsigned long)length)); /* (1) */
+}
+
+int server_end(server * s)
+{
+    output_flush(&s->out); /* (2) */
+    s->out.fd = -1;
+    return !s->out.failed;
+}
+
+int server_send(server * s, int fd, const char * status) /* (3) */
+{
+    server_begin(s, fd, status, s->text.used);
+    output_write(&s->out, s->text.buffer, s->text.used);
+    s->text.used = 0;
+    return server_end(s);
+}
+
+void server_say(server * s, const char * string, size_t length)
+{
+    output_write(&s->text, string, length);
+}
+
+void server_location(server * s, region * r, code_chunk * c)
+{
+    char line[32];
+    server_say(s, s->doc->file, strlen(s->doc->file));
+    server_say(s, line, sprintf(line, ":%d: ", r->line - 1));
+    server_say(s, c->name, c->name_length);
+    server_say(s, "\n", 1);
+}
+int server_expand(server * s, int fd, code_chunk * c)
+{
+    dict * d = s->doc->chunks;
+    emit * e;
+    size_t length = 0;
+    unsigned long errors;
+    char count[32];
+
+    s->state = realloc(s->state, (d->count + 1) * sizeof(int));
+    exit_fail_if(s->state == NULL, "Error: Out of memory\n");
+    memset(s->state, 0, (d->count + 1) * sizeof(int));
+    errors = code_chunk_resolve(&s->stack, s->state, c); /* (1) */
+    if (errors != 0)
+    {
+        server_say(s, "Error: found ", 12);
+        server_say(s, count, sprintf(count, "%lu", errors));
+        server_say(s, " invalid invocation(s)\n", 23);
+        return server_send(s, fd, "error");
+    }
+    plan_compile(&s->plan, c, &s->doc->reuse);
+    for (e = s->plan.emits; e != s->plan.emits + s->plan.count; ++e) /* (2) */
+        length += e->indent_length + e->length;
+    server_begin(s, fd, "ok", length);
+    plan_emit(&s->plan, &s->out);
+    return server_end(s);
+}
+int server_lookup(server * s, int fd, code_chunk * c)
+{
+    size_t i;
+    server_index(s);
+    for (i = s->defined_first[c->index]; i < s->defined_last[c->index]; ++i)
+        server_location(s, s->definitions[i], c);
+    return server_send(s, fd, "ok");
+}
+
+int server_uses(server * s, int fd, code_chunk * c)
+{
+    size_t i, j;
+    server_index(s);
+    for (i = s->users.first[c->index]; i < s->users.last[c->index]; ++i)
+    {
+        code_chunk * user = s->users.chunks[i];
+        for (j = s->defined_first[user->index]; j < s->defined_last[user->index]; ++j)
+        {
+            region * r = s->definitions[j];
+            chunk_contents * contents = r->first;
+            for (; contents != NULL; contents = contents == r->last ? NULL : contents->successor)
+                if (contents->reference == c) break; /* (1) */
+            if (contents == NULL) continue;
+            server_location(s, r, user);
+            break;
+        }
+    }
+    return server_send(s, fd, "ok");
+}
+int server_error(server * s, int fd, const char * message, const char * name, size_t length)
+{
+    server_say(s, "Error: ", 7);
+    server_say(s, message, strlen(message));
+    server_say(s, " '", 2);
+    server_say(s, name, length);
+    server_say(s, "'\n", 2);
+    return server_send(s, fd, "error");
+}
+
+int server_answer(server * s, int fd, const char * query, size_t length)
+{
+    const char * space = memchr(query, ' ', length); /* (1) */
+    size_t command = space != NULL ? (size_t)(space - query) : length;
+    const char * name = space != NULL ? space + 1 : query + length;
+    size_t name_length = query + length - name;
+    code_chunk * c = dict_get(s->doc->chunks, name, name_length);
+
+    if (!s->ready) /* (2) */
+        return server_error(s, fd, "Can't answer while there are errors in", s->doc->file, strlen(s->doc->file));
+    if (c == NULL || !c->defined) /* (3) */
+        return server_error(s, fd, "No chunk named", name, name_length);
+    if (command == 6 && strncmp(query, "expand", 6) == 0) return server_expand(s, fd, c);
+    if (command == 6 && strncmp(query, "lookup", 6) == 0) return server_lookup(s, fd, c);
+    if (command == 4 && strncmp(query, "uses", 4) == 0) return server_uses(s, fd, c);
+    return server_error(s, fd, "Unknown query", query, command); /* (4) */
+}
+int server_read(server * s, client * c)
+{
+    const char * query;
+    const char * end;
+    ssize_t n;
+    if (c->used == c->capacity) /* (3) */
+    {
+        if (c->capacity >= SERVER_QUERY) return 0;
+        c->capacity = c->capacity ? c->capacity * 2 : 256;
+        c->buffer = realloc(c->buffer, c->capacity);
+        exit_fail_if(c->buffer == NULL, "Error: Out of memory\n");
+    }
+    n = read(c->fd, c->buffer + c->used, c->capacity - c->used);
+    if (n < 0 && errno == EINTR) return 1;
+    if (n <= 0) return 0;
+    c->used += n;
+    query = c->buffer;
+    while ((end = memchr(query, '\n', c->buffer + c->used - query)) != NULL) /* (1) */
+    {
+        if (!server_answer(s, c->fd, query, end - query)) return 0;
+        query = end + 1;
+    }
+    c->used -= query - c->buffer; /* (2) */
+    memmove(c->buffer, query, c->used);
+    return 1;
+}
+void server_accept(server * s)
+{
+    struct timeval second = {1, 0};
+    client * c;
+    int fd = accept(s->fd, NULL, NULL); /* (1) */
+    if (fd < 0) return;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &second, sizeof(second)); /* (2) */
+    if (s->count == s->capacity)
+    {
+        s->capacity = s->capacity ? s->capacity * 2 : 16;
+        s->clients = realloc(s->clients, s->capacity * sizeof(client));
+        s->polls = realloc(s->polls, (s->capacity + 2) * sizeof(struct pollfd));
+        exit_fail_if(s->clients == NULL || s->polls == NULL, "Error: Out of memory\n");
+    }
+    c = s->clients + s->count++;
+    c->fd = fd;
+    c->buffer = NULL;
+    c->used = 0;
+    c->capacity = 0;
+}
+
+void server_hang_up(server * s, size_t i)
+{
+    close(s->clients[i].fd);
+    free(s->clients[i].buffer);
+    s->clients[i] = s->clients[--s->count]; /* (3) */
+}
+void server_wait(server * s, watcher * w, document * doc, int ready)
+{
+    server_forget(s);
+    s->doc = doc;
+    s->ready = ready;
+    if (s->polls == NULL)
+    {
+        s->polls = malloc(2 * sizeof(struct pollfd));
+        exit_fail_if(s->polls == NULL, "Error: Out of memory\n");
+    }
+    for (;;)
+    {
+        size_t i;
+        struct stat st;
+        s->polls[0].fd = s->fd;
+        s->polls[1].fd = w->fd;
+        for (i = 0; i < s->count; ++i) s->polls[i + 2].fd = s->clients[i].fd;
+        for (i = 0; i < s->count + 2; ++i) s->polls[i].events = POLLIN;
+        if (poll(s->polls, s->count + 2, w->fd >= 0 ? -1 : 100) < 0) continue;
+        if (s->polls[1].revents != 0 && watcher_read(w)) return; /* (3) */
+        if (w->fd < 0 && watcher_stat(w, &st)) /* (4) */
+        {
+            w->st = st;
+            return;
+        }
+        for (i = s->count; i-- > 0;) /* (2) */
+            if (s->polls[i + 2].revents != 0 && !server_read(s, s->clients + i))
+                server_hang_up(s, i);
+        if (s->polls[0].revents != 0) server_accept(s); /* (1) */
+    }
+}
+void document_init(document * doc, const char * file)
+{
+    source_stream stream = {-1, NULL, NULL, 0, 0};
+    region_map regions = {0, 0, NULL, 0, 0, NULL, 0, NULL, 0, 0};
+    arena memory = {NULL, 4096, 0, 0, 0};
+    doc->file = file;
+    doc->atsign = '@';
+    doc->line_number = 1;
+    doc->end_of_source = NULL;
+    doc->mapped_source = NULL;
+    doc->mapped_size = 0;
+    doc->stream = stream;
+    doc->regions = regions;
+    doc->memory = memory;
+    doc->chunks = dict_new(64); /* for storing chunks; grows as needed */
+    doc->tangles = NULL;
+    doc->reuse.entries = NULL;
+    doc->reuse.sources = NULL;
+    doc->reuse.hits = 0;
+    doc->reuse.misses = 0;
+    pthread_mutex_init(&doc->reuse.lock, NULL);
+    doc->snapshot = 0;
+}
+
+void document_forget(document * doc)
+{
+    source_close(doc);
+    if (doc->mapped_source != NULL) munmap((void *)doc->mapped_source, doc->mapped_size); /* (1) */
+    doc->mapped_source = NULL;
+    region_map_clear(doc);
+    arena_reset(&doc->memory); /* (2) */
+    dict_clear(doc->chunks);
+    doc->atsign = '@'; /* (3) */
+    doc->line_number = 1;
+    doc->tangles = NULL;
+    doc->snapshot = 0;
+}
+
+void document_free(document * doc)
+{
+    document_forget(doc);
+    arena_free(&doc->memory);
+    free(doc->regions.regions);
+    free(doc->chunks->array);
+    free(doc->chunks);
+    reuse_clear(&doc->reuse);
+    pthread_mutex_destroy(&doc->reuse.lock);
+}
+
+const char * help =
+"lili: the little literate programming tool -- version %s\n\
+\n\
+    USAGE: %s [options] file\n\
+           %s [options] --batch list\n\
+           %s --locate file:line...\n\
+\n\
+    lili extracts machine source code from literate source code. If file is\n\
+    -, the literate source is read from the standard input.\n\
+\n\
+OPTIONS\n\
+\n\
+--stats                       Print statistics about the run to stderr, such as\n\
+                              how much memory was allocated and how long each\n\
+                              phase of the run and each tangled file took.\n\
+\n\
+--stats=json                  Print the same statistics as a JSON object on a\n\
+                              single line.\n\
+\n\
+-j N                          Write up to N tangled files at the same time, or\n\
+                              with --batch, tangle up to N documents at once.\n\
+\n\
+--update                      Only write tangled files whose contents differ\n\
+                              from the existing file, and replace them\n\
+                              atomically rather than rewriting them in place.\n\
+\n\
+--cache FILE                  Remember what was tangled in FILE, and only\n\
+                              expand and write tangled files whose contents\n\
+                              may have changed since the last run.\n\
+\n\
+--graph FILE                  Write the graph of chunks and invocations to FILE\n\
+                              as JSON, including where each chunk is defined\n\
+                              and which chunks each tangled file is made of.\n\
+\n\
+--depfile FILE                Write a Make dependency file to FILE, saying\n\
+                              that the tangled files depend on the source.\n\
+\n\
+--linemap                     Write a line map alongside every tangled file,\n\
+                              in a file with the same name followed by\n\
+                              .linemap, saying which line of the source each\n\
+                              of its lines came from.\n\
+\n\
+--locate FILE:LINE...         Print the line of the source that line LINE of\n\
+                              the tangled file FILE came from, using the line\n\
+                              map written with --linemap, for every FILE:LINE.\n\
+\n\
+--snapshot FILE               Save the parsed document in FILE, and on later\n\
+                              runs, load it from FILE instead of parsing the\n\
+                              source again, as long as the source is unchanged.\n\
+\n\
+--weave FILE                  Write a copy of the document to FILE for reading,\n\
+                              with the control sequences replaced by the names\n\
+                              of the chunks they define or invoke, and where\n\
+                              each chunk is defined and used.\n\
+\n\
+--batch FILE                  Tangle every document listed in FILE, one path\n\
+                              per line, as if lili were run on each of them in\n\
+                              turn, but in a single process. With -j N, up to N\n\
+                              documents are tangled at the same time. If FILE\n\
+                              is -, the list is read from the standard input.\n\
+\n\
+--watch                       Keep running, and tangle the file again whenever\n\
+                              it changes, only writing tangled files whose\n\
+                              contents changed. Errors in the file are reported\n\
+                              and the file is tangled again once it changes.\n\
+\n\
+--serve SOCKET                Keep running as with --watch, and answer queries\n\
+                              about the chunks on the Unix socket SOCKET: a\n\
+                              line with expand, lookup or uses, a space and a\n\
+                              chunk name gets the chunk's expansion, where it\n\
+                              is defined, or which chunks invoke it.\n\
+\n\
+CONTROL SEQUENCES\n\
+\n\
+All control sequences begin with a special character called ATSIGN, which is \n\
+set to '@' by default. Except for escaped ATSIGNs, all control sequences consume\n\
+(i.e. cause to be ignored) the remainder of the line following the end of the\n\
+control sequence.\n\
+\n\
+ATSIGN:new control character  Redefines ATSIGN to whatever immediately follows\n\
+                              the : sign. This is useful if your machine source\n\
+                              language uses lots of @ signs, for example. This\n\
+                              control sequence is ignored if it occurs inside\n\
+                              a code chunk definition.\n\
+\n\
+ATSIGN='chunk name'           Begin a regular chunk definition. The chunk name\n\
+                              must be surrounded by matching single (') or\n\
+                              double (\") quotes (no backticks). The chunk\n\
                               definition itself begins on the next line.\n\
                               Anything preceeding the ATSIGN and following the\n\
                               final quote sign is ignored, allowing this control\n\
@@ -328,6 +3267,13 @@ ATSIGN#'chunk name'           Begin a tangle chunk definition. This is similar\n
                               is recursively expanded into the file with that\n\
                               name, overwriting any existing file.\n\
 \n\
+ATSIGN*'chunk name'           Begin a reusable chunk definition. This is\n\
+                              similar to a regular chunk, except that the chunk\n\
+                              may be invoked any number of times, e.g. to put\n\
+                              the same license header at the top of many files.\n\
+                              Chunks it invokes are expanded wherever it is,\n\
+                              even if they are regular chunks.\n\
+\n\
 ATSIGN+'chunk name'           Append to a chunk. The code starting on the\n\
                               next line will be added at the end of the chunk\n\
                               named by 'chunk name'. This is useful e.g. for\n\
@@ -362,239 +3308,474 @@ ATSIGN[anything else]         An ATSIGN followed by any other character is\n\
                               extensions.\n\
 \n";
 
-void lili(char * file, dict * d, list ** tangles)
+void lili(document * doc, double * loaded)
 {
-    char * source;
+    const char * source;
+    const char * file = doc->file;
 
     {
-        int file_size;
-        size_t fread_size;
-        FILE * source_file = fopen(file, "r");
-        exit_fail_if ( (source_file == NULL)
+        size_t file_size;
+        struct stat st;
+        int fd = strcmp(file, "-") == 0 ? STDIN_FILENO : open(file, O_RDONLY);
+        exit_fail_if ( (fd < 0)
                      , "Error: Could not open source file %s\n", file
                      );
-        
-        /* get file size */
-        fseek(source_file, 0L, SEEK_END);
-        file_size = ftell(source_file);
-        rewind(source_file);
-        
-        /* copy file into memory */
-        source = malloc(1 + file_size); /* one added for null termination */
-        fread_size = fread(source, 1, file_size, source_file);
-        if (fread_size != file_size) fprintf(stderr, "Warning: fread_size doesn't match file_size???\n");
-        fclose(source_file);
-        
-        source[file_size] = 0;
-    }
-
-    {
-        char * s = source;
-        while (*s != '\0')
-        {
-            if (*s == '\n') ++s, ++line_number;
-            else if (*s++ == ATSIGN)
+        exit_fail_if ( (fstat(fd, &st) != 0)
+                     , "Error: Could not stat source file %s\n", file
+                     );
+
+        file_size = st.st_size;
+        source = NULL;
+        if (S_ISREG(st.st_mode) && file_size > 0) /* (1) */
+        {
+            void * map = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) source = doc->mapped_source = map, doc->mapped_size = file_size;
+        }
+        if (source == NULL) /* (2) */
+        {
+            doc->stream.fd = fd;
+            doc->stream.name = file;
+            source = doc->end_of_source = doc->stream.buffer;
+        }
+        else
+        {
+            close(fd);
+            doc->end_of_source = source + file_size;
+
+            /* roughly one contents entry per line of source, so this is usually
+             * enough to parse the whole document out of a single block */
+            arena_reserve(&doc->memory, file_size);
+        }
+    }
+    *loaded = seconds();
+
+    {
+        const char * s = source;
+        while (s < doc->end_of_source || source_refill(doc, &s)) /* (4) */
+        {
+            const char * at = memchr(s, doc->atsign, doc->end_of_source - s); /* (1) */
+            if (at == NULL) at = doc->end_of_source;
+            doc->line_number += count_newlines(s, at); /* (2) */
+            s = at;
+            if (s == doc->end_of_source) continue; /* (3) */
+            ++s;
+            switch (s < doc->end_of_source ? *s : '\n')
             {
-                switch (*s)
+            case '#':
+            case '=':
+            case '*':
+            case '+':
+                if (s + 1 == doc->end_of_source || (*(s + 1) != '\'' && *(s + 1) != '\"')) 
                 {
-                case '#':
-                case '=':
-                case '+':
-                    if (*(s + 1) != '\'' && *(s + 1) != '\"') 
-                    {
-                        exit_fail_if(1
-                                    , "Error: Chunk definition sequence on line %d is missing a "
-                                      "quote-delimited name. Ignoring\n"
-                                    , line_number
-                                    );
-                        break;
-                    }
-                    else
+                    exit_fail_if(1
+                                , "Error: Chunk definition sequence on line %d is missing a "
+                                  "quote-delimited name. Ignoring\n"
+                                , doc->line_number
+                                );
+                    break;
+                }
+                else
+                {
+                    const char * control = s - 1;
+                    const char * body;
+                    chunk_contents * previous;
+                    int body_line;
+                    code_chunk * chunk;
                     {
-                        code_chunk * chunk;
+                        /* (1) */
+                        int tangle = *s == '#';
+                        int reusable = *s == '*';
+                        int append = *s == '+';
+
+                        size_t name_length;
+                        const char * name;
+
+                        ++s; /* (2.a) */
+                        name = extract_name(doc, &s, &name_length); /* (2.b) */
+                        chunk = dict_get(doc->chunks, name, name_length); /* (3) */
+
+                        if (chunk == NULL) /* (4) new chunk definition */
                         {
-                            /* (1) */
-                            int tangle = *s == '#';
-                            int append = *s == '+';
-
-                            ++s; /* (2.a) */
-                            char * name = extract_name(&s); /* (2.b) */
-                            chunk = dict_get(d, name); /* (3) */
-
-                            if (chunk == NULL) /* (4) new chunk definition */
-                            {
-                                chunk = code_chunk_new(name);
-                                dict_add(d, chunk);
-                            }
-                            else if (!append) /* (5) */
-                            {
-                                exit_fail_if(chunk->contents != NULL /* (6) */
-                                            , "Error: Redefinition of chunk '%s' on line %d.\n"
-                                              "       Maybe you meant to use a + chunk or accidentally "
-                                              "used the same name twice?\n"
-                                            , name, line_number
-                                            );
-                                /* todo: free existing chunk? */
-                            }
-                            if (tangle)
-                            {
-                                chunk->tangle = 1; /* (7.a) */
-                                list_push(tangles, (void *)chunk); /* (7.b) */
-                            }
+                            chunk = code_chunk_new(&doc->memory, source_keep(doc, name, name_length), name_length);
+                            dict_add(doc->chunks, chunk);
                         }
-
-                        exit_fail_if(!advance_to_next_line(&s) /* (8) */
-                                    , "Error: File ended before beginning of definition of chunk '%s' "
-                                      "on line '%d'\n"
-                                    , chunk->name, line_number
-                                    );
+                        else if (!append) /* (5) */
+                        {
+                            exit_fail_if(chunk->defined /* (6) */
+                                        , "Error: Redefinition of chunk '%.*s' on line %d.\n"
+                                          "       Maybe you meant to use a + chunk or accidentally "
+                                          "used the same name twice?\n"
+                                        , (int)name_length, name, doc->line_number
+                                        );
+                            /* todo: free existing chunk? */
+                        }
+                        if (!chunk->defined) /* (7) */
                         {
-                            char * start_of_line = s; /* (1) */
-                            for (;;)
-                            {
-                                if (*s == '\n') /* (2.a) */
-                                {
-                                    chunk_contents * full_line = code_contents_new(start_of_line); /* (1) */
-                                    list_push_back(&chunk->contents, (void *)full_line); /* (2) */
-                                    ++line_number; /* (3) */
-                                    *s++ = '\0'; /* (4) */
-                                    start_of_line = s; /* (3.a) */
-                                }
-                                else if (*s == ATSIGN) /* (2.b) */
-                                {
-                                    ++s;
-                                    if (*s == '/')
-                                    {
-                                        advance_to_next_line(&s);
-                                        break;
-                                    }
-                                    else if (*s == '{')
-                                    {
-                                        code_chunk * ref;
-                                        char * indent = start_of_line; /* (1.a) */
-
-                                        {
-                                            char * end_of_indent = s - 1; /* (1.b) */
-                                            *end_of_indent = '\0'; /* (1.c) */
-                                        }
-
-                                        {
-                                            char * name = extract_name(&s); /* (2.a) */
-                                            ref = dict_get(d, name); /* (2.b) */
-                                            if (ref == NULL) /* chunk hasn't been defined yet */
-                                            {
-                                                ref = code_chunk_new(name); /* (2.c) */
-                                                dict_add(d, ref);
-                                            }
-                                            exit_fail_if(!advance_to_next_line(&s) /* (4) */
-                                                        , "Error: File ended during definition of chunk '%s'\n"
-                                                          "       following invocation of chunk '%s' on line '%d'\n"
-                                                        , chunk->name, name, line_number
-                                                        );
-                                        }
-
-                                        list_push_back(&chunk->contents, (void *)reference_contents_new(indent, ref)); /* (3) */
-                                    }
-                                    else if (*s == ATSIGN)
-                                    {
-                                        chunk_contents * beginning_part = code_contents_new(start_of_line);
-                                        chunk_contents * ending_part = code_contents_new(s);
-                                        char * at_the_atsign = s - 1;
-
-                                        exit_fail_if(!advance_to_next_line(&s)
-                                                , "Error: File ended during definition of chunk '%s'\n"
-                                                  "       following the escape sequence on line '%d'\n"
-                                                , chunk->name, line_number);
-
-                                        /* (1) */
-                                        *at_the_atsign = '\0'; /* terminate beginning part */
-                                        *(s - 1) = '\0'; /* terminate end part; s - 1 points to a newline character */
-
-                                        beginning_part->partial_line = 1; /* (2) */
-
-                                        list_push_back(&chunk->contents, (void *)beginning_part);
-                                        list_push_back(&chunk->contents, (void *)ending_part);
-                                    }
-                                    else /* (3.c) */
-                                    {
-                                        exit_fail_if(1, "Error: Unrecognized control sequence ATSIGN%c "
-                                                        "while parsing chunk on line %d\n"
-                                                    , *s, line_number
-                                                    );
-                                        continue; /* (3.d) */
-                                    }
-                                    start_of_line = s; /* (3.b) */
-                                }
-                                else /* (4) */ 
-                                {
-                                    exit_fail_if(*s == '\0'
-                                                , "Error: File ended during definition of chunk %s"
-                                                , chunk->name
-                                                );
-                                    ++s;
-                                }
-                            }
+                            chunk->defined = 1;
+                            chunk->line = doc->line_number;
                         }
+                        if (tangle)
+                        {
+                            chunk->tangle = 1; /* (8.a) */
+                            list_push(&doc->memory, &doc->tangles, (void *)chunk); /* (8.b) */
+                        }
+                        if (reusable) chunk->reusable = 1; /* (8.c) */
                     }
-                    break;
-                case ':':
-                    ++s;
-                    exit_fail_if ( (  *s == '=' || *s == '#' || *s == '+'
-                                   || *s == '{' || *s == ':' || *s == '/'
-                                   || *s == '\n'
-                                   )
-                                 , "Error: Cannot redefine ATSIGN to a character "
-                                   "used in control sequences on line %d\n"
-                                 , line_number
-                                 );
-                    ATSIGN = *s++;
-                    break;
-                default:
-                    exit_fail_if(1
-                                , "Error: Unrecognized control sequence ATSIGN%c "
-                                  "while scanning prose on line %d\n"
-                                , *s, line_number
+
+                    exit_fail_if(!advance_to_next_line(doc, &s) /* (9) */
+                                , "Error: File ended before beginning of definition of chunk '%.*s' "
+                                  "on line '%d'\n"
+                                , (int)chunk->name_length, chunk->name, doc->line_number
                                 );
+                    body = s;
+                    body_line = doc->line_number;
+                    previous = chunk->last;
+                    s = parse_chunk(doc, chunk, s);
+                    if (doc->regions.record) region_add(doc, chunk, source, control, body, s, body_line, previous);
                 }
+                break;
+            case ':':
+                ++s;
+                exit_fail_if ( (  s == doc->end_of_source
+                               || *s == '=' || *s == '#' || *s == '+' || *s == '*'
+                               || *s == '{' || *s == ':' || *s == '/'
+                               || *s == '\n'
+                               )
+                             , "Error: Cannot redefine ATSIGN to a character "
+                               "used in control sequences on line %d\n"
+                             , doc->line_number
+                             );
+                doc->atsign = *s++;
+                if (doc->regions.record) region_add(doc, NULL, source, s - 3, s, s, doc->line_number, NULL);
+                break;
+            default:
+                exit_fail_if(1
+                            , "Error: Unrecognized control sequence ATSIGN%c "
+                              "while scanning prose on line %d\n"
+                            , s < doc->end_of_source ? *s : ' ', doc->line_number
+                            );
             }
         }
     }
+
+    if (doc->regions.keep && doc->stream.fd < 0) region_map_keep(doc, source, doc->end_of_source - source);
+    source_close(doc);
+}
+
+char ** batch_read(const char * path, size_t * count)
+{
+    char ** files = NULL;
+    size_t capacity = 0;
+    char * line = NULL;
+    size_t size = 0;
+    ssize_t length;
+    FILE * f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    exit_fail_if(f == NULL, "Error: Could not open batch file %s\n", path);
+
+    *count = 0;
+    while ((length = getline(&line, &size, f)) > 0) /* (1) */
+    {
+        if (line[length - 1] == '\n') line[--length] = '\0';
+        if (length == 0) continue; /* (2) */
+        if (*count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            files = realloc(files, capacity * sizeof(char *));
+            exit_fail_if(files == NULL, "Error: Out of memory\n");
+        }
+        files[*count] = strdup(line);
+        exit_fail_if(files[(*count)++] == NULL, "Error: Out of memory\n");
+    }
+    free(line);
+    if (f != stdin) fclose(f);
+    return files;
+}
+typedef struct Batch
+{
+    char ** files;
+    size_t count;
+    size_t next;
+    size_t failed;
+    int update;
+    int linemap;
+    pthread_mutex_t lock;
+} batch;
+
+typedef struct BatchWorker
+{
+    batch * job;
+    document doc;
+    output out;
+    plan plan;
+    jmp_buf retry;
+    pthread_t thread;
+} batch_worker;
+
+void * batch_worker_run(void * arg)
+{
+    batch_worker * w = arg;
+    pthread_setspecific(recovery, &w->retry); /* (3) */
+    for (;;)
+    {
+        size_t i;
+        pthread_mutex_lock(&w->job->lock); /* (1) */
+        i = w->job->next++;
+        pthread_mutex_unlock(&w->job->lock);
+        if (i >= w->job->count) break;
+
+        document_forget(&w->doc);
+        w->doc.file = w->job->files[i];
+        w->out.fd = -1;
+        w->out.used = 0;
+        if (setjmp(w->retry) == 0)
+        {
+            double loaded;
+            size_t j, count;
+            tangle * files;
+            lili(&w->doc, &loaded);
+            files = document_resolve(&w->doc, w->job->update, w->job->linemap, &count);
+            for (j = 0; j < count; ++j) tangle_file(&w->out, &w->plan, &files[j]); /* (2) */
+            if (tangle_errors(files, count) == 0) continue;
+        }
+        fprintf(stderr, "Error: Failed to tangle %s\n", w->doc.file); /* (4) */
+        pthread_mutex_lock(&w->job->lock);
+        w->job->failed += 1;
+        pthread_mutex_unlock(&w->job->lock);
+    }
+    pthread_setspecific(recovery, NULL);
+    return NULL;
+}
+int batch_tangle(const char * path, int jobs, int update, int linemap, stats_format stats)
+{
+    batch job;
+    batch_worker * workers;
+    int i, started = 0;
+    double start = seconds();
+
+    job.files = batch_read(path, &job.count);
+    job.next = 0;
+    job.failed = 0;
+    job.update = update;
+    job.linemap = linemap;
+    pthread_mutex_init(&job.lock, NULL);
+
+    if (jobs > (int)job.count) jobs = job.count;
+    if (jobs < 1) jobs = 1;
+    workers = calloc(jobs, sizeof(batch_worker));
+    exit_fail_if(workers == NULL, "Error: Out of memory\n");
+    for (i = 0; i < jobs; ++i)
+    {
+        workers[i].job = &job;
+        document_init(&workers[i].doc, NULL);
+        output_init(&workers[i].out, 1 << 20);
+    }
+
+    for (i = 1; i < jobs; ++i)
+    {
+        if (pthread_create(&workers[i].thread, NULL, batch_worker_run, &workers[i]) != 0)
+            break;
+        ++started;
+    }
+    batch_worker_run(&workers[0]);
+    for (i = 1; i <= started; ++i) pthread_join(workers[i].thread, NULL);
+
+    if (stats == text_stats)
+        fprintf(stderr, "batch: %lu documents, %lu failed, %.2f ms with %d workers\n"
+               , (unsigned long)job.count, (unsigned long)job.failed
+               , (seconds() - start) * 1e3, started + 1
+               );
+    else if (stats == json_stats)
+        fprintf(stderr, "{\"documents\": %lu, \"failed\": %lu, \"time_ms\": %.3f, "
+                        "\"workers\": %d}\n"
+               , (unsigned long)job.count, (unsigned long)job.failed
+               , (seconds() - start) * 1e3, started + 1
+               );
+
+    for (i = 0; i < jobs; ++i)
+    {
+        document_free(&workers[i].doc);
+        output_free(&workers[i].out);
+        plan_free(&workers[i].plan);
+    }
+    for (i = 0; (size_t)i < job.count; ++i) free(job.files[i]);
+    free(job.files);
+    free(workers);
+    pthread_mutex_destroy(&job.lock);
+    return job.failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 int main(int argc, char ** argv)
 {
-    dict * d;
-    list * tangles = NULL;
+    document doc;
+    output out;
+    tangle * files = NULL;
+    size_t count = 0;
     char * file;
+    char * batch = NULL;
+    char * cache = NULL;
+    char * graph = NULL;
+    char * depfile = NULL;
+    char * weave = NULL;
+    char * snapshot = NULL;
+    char * serve = NULL;
+    int update = 0;
+    int linemap = 0;
+    char ** locate = NULL;
+    stats_format stats = no_stats;
+    int jobs = 1;
+    int watch = 0;
+    watcher w;
+    server queries;
+    int ready = 0;
+    cache_memo memo = {NULL, NULL, 0};
+    jmp_buf retry;
+    run_times times;
+
+    pthread_key_create(&recovery, NULL);
 
-    if (argc < 2 || argc > 2 || *argv[1] == '-' /* assume -h */) 
     {
-        fprintf(stderr, help, VERSION, argv[0]);
-        exit(EXIT_SUCCESS);
+        int i;
+        file = NULL;
+        for (i = 1; i < argc; ++i)
+        {
+            if (strcmp(argv[i], "--stats") == 0) stats = text_stats;
+            else if (strcmp(argv[i], "--stats=json") == 0) stats = json_stats;
+            else if (strcmp(argv[i], "--update") == 0) update = 1;
+            else if (strcmp(argv[i], "--watch") == 0) watch = 1;
+            else if (strcmp(argv[i], "--linemap") == 0) linemap = 1;
+            else if (strcmp(argv[i], "--locate") == 0 && i + 1 < argc)
+            {
+                locate = argv + i + 1;
+                i = argc;
+            }
+            else if (strcmp(argv[i], "--batch") == 0)
+            {
+                if ((batch = argv[++i]) == NULL) break;
+            }
+            else if (strcmp(argv[i], "--cache") == 0)
+            {
+                if ((cache = argv[++i]) == NULL) break;
+            }
+            else if (strcmp(argv[i], "--graph") == 0)
+            {
+                if ((graph = argv[++i]) == NULL) break;
+            }
+            else if (strcmp(argv[i], "--depfile") == 0)
+            {
+                if ((depfile = argv[++i]) == NULL) break;
+            }
+            else if (strcmp(argv[i], "--weave") == 0)
+            {
+                if ((weave = argv[++i]) == NULL) break;
+            }
+            else if (strcmp(argv[i], "--snapshot") == 0)
+            {
+                if ((snapshot = argv[++i]) == NULL) break;
+            }
+            else if (strcmp(argv[i], "--serve") == 0)
+            {
+                if ((serve = argv[++i]) == NULL) break;
+                watch = 1;
+            }
+            else if (strncmp(argv[i], "-j", 2) == 0)
+            {
+                char * n = argv[i][2] != '\0' ? argv[i] + 2 : argv[++i];
+                if (n == NULL || (jobs = atoi(n)) < 1) break;
+            }
+            else if ((*argv[i] == '-' && argv[i][1] != '\0') || file != NULL) break; /* assume -h */
+            else file = argv[i];
+        }
+        if (locate == NULL && (i < argc || (file == NULL) == (batch == NULL)))
+        {
+            fprintf(stderr, help, VERSION, argv[0], argv[0], argv[0]);
+            exit(EXIT_SUCCESS);
+        }
+        if (locate != NULL) exit(line_map_locate(locate, argc - (locate - argv)));
+        exit_fail_if(  batch != NULL
+                    && (  watch || cache != NULL || graph != NULL || depfile != NULL
+                       || weave != NULL || snapshot != NULL
+                       )
+                    , "Error: --batch can't be used with --watch, --cache, --graph, --depfile, "
+                      "--weave or --snapshot\n"
+                    );
+        exit_fail_if(snapshot != NULL && (watch || weave != NULL || strcmp(file, "-") == 0)
+                    , "Error: --snapshot can't be used with --watch, --weave or the standard input\n"
+                    );
+        exit_fail_if(watch && strcmp(file, "-") == 0
+                    , "Error: Can't watch the standard input for changes\n"
+                    );
+        exit_fail_if(weave != NULL && strcmp(file, "-") == 0
+                    , "Error: Can't weave the standard input\n"
+                    );
+        if (watch)
+        {
+            watcher_init(&w, file);
+            if (serve != NULL) server_init(&queries, serve);
+            pthread_setspecific(recovery, &retry);
+        }
     }
-    file = argv[1];
 
-    d = dict_new(128); /* for storing chunks */
+    output_init(&out, 1 << 20);
 
-    lili(file, d, &tangles);
+    if (batch != NULL) return batch_tangle(batch, jobs, update, linemap, stats);
 
-    for(; tangles != NULL; tangles = tangles->successor) /* (1) */
+    document_init(&doc, file);
+    doc.regions.record = watch || graph != NULL || weave != NULL || snapshot != NULL;
+    doc.regions.keep = watch;
+    for (;;)
     {
-        FILE * f;
-        code_chunk * c = tangles->data;
+        if (!watch || setjmp(retry) == 0)
+        {
+            times.started = times.loaded = seconds();
+            if (!reparse(&doc, &times.loaded))
+            {
+                document_forget(&doc);
+                if (snapshot == NULL || !snapshot_load(snapshot, &doc, &times.loaded))
+                {
+                    document_forget(&doc);
+                    lili(&doc, &times.loaded);
+                    if (snapshot != NULL) snapshot_write(snapshot, &doc);
+                }
+            }
+            times.parsed = seconds();
 
+            files = document_resolve(&doc, update, linemap, &count); /* (1) */
+            times.resolved = seconds();
 
-        f = fopen(c->name, "w"); /* (2) */
-        if (f == NULL)
-        {
-            exit_fail_if(1, "Error: Failed to open file '%s', skipping tangle\n"
-                        , c->name
-                        );
-            continue;
+            if (cache != NULL && memo.entries == NULL) cache_read(cache, &doc, files, count);
+            else if (watch) cache_recall(&memo, &doc, files, count);
+
+            tangle_files(files, count, jobs, &out); /* (2) */
+
+            if (cache != NULL) cache_write(cache, files, count);
+            if (watch) cache_remember(&memo, files, count);
+
+            if (tangle_errors(files, count) != 0) give_up(); /* (3) */
+
+            times.tangled = seconds();
+            if (graph != NULL) graph_write(graph, &doc, files, count);
+            if (depfile != NULL) depfile_write(depfile, file, files, count);
+            if (weave != NULL) weave_write(weave, &doc);
+            if (stats != no_stats)
+            {
+                run_counts counts;
+                run_counts_collect(&counts, doc.chunks, files, count);
+                if (stats == json_stats) stats_print_json(stderr, &times, &counts, &doc, &out, files, count);
+                else stats_print_text(stderr, &times, &counts, &doc, &out, files, count);
+            }
+            ready = 1;
         }
-        code_chunk_print(f, d, c, NULL, 1); /* (3) */
-        fclose(f);
+        else ready = 0;
+        if (!watch) break;
+        if (serve != NULL) server_wait(&queries, &w, &doc, ready);
+        else watcher_wait(&w);
+        out.fd = -1;
+        out.used = 0;
+        out.bytes = 0;
+        out.writes = 0;
     }
 
+    output_free(&out);
+    document_free(&doc);
     return 0;
 }